@@ -8,16 +8,42 @@
 #ifndef _AT24C32_H_
 #define _AT24C32_H_
 
+#include "i2c_async.h"
+
 // Defines:
 #define I2C_ADDRESS_AT24C32	0x57	// This can be any address in the range 0x50 through 0x57, depending on A2:A0 pin strapping
 #define AT24C32_BYTE_COUNT  4096    // The at24c32 is a 4K byte device (32Kbit)
 #define AT24C32_PAGE_WRITE_SIZE 32  // Up to 32 bytes for a page write
+#define AT24C32_WRITE_TIMEOUT_US 20000 // Give up ACK polling after 20ms (datasheet tWR max is 10ms)
+
+// at24c32_write_poll() return values
+#define AT24C32_READY    0
+#define AT24C32_BUSY     1
+#define AT24C32_TIMEOUT  (-1)
+
+// Page write transaction - storage address and data segments, see at24c32_page_xfer()
+typedef struct {
+	I2C_XFER xfer;
+	uint8_t addr[2];         // storage address, high byte first
+	I2C_SEGMENT seg[2];      // storage address, data
+} AT24C32_PAGE;
+
+uint16_t at24c32_page_bytes(uint16_t address, uint16_t count);
+int at24c32_page_xfer(AT24C32_PAGE * page, uint16_t address, const uint8_t * data, uint16_t count);
+int at24c32_write_page(uint16_t address, const uint8_t * data, uint16_t count);
+int at24c32_write_poll(void);
+int at24c32_write_wait(void);
+int at24c32_write(uint16_t address, const uint8_t * data, uint16_t count);
+int at24c32_read(uint16_t address, uint8_t * data, uint16_t count);
 
 int cl_read_at24c32(void);
 int cl_write_at24c32(void);
 int cl_fill_at24c32(void);
 int cl_dump_at24c32(void);
 int cl_write_at24c32_256(void);
+void at24c32_twr_reset(void);
+void at24c32_twr_display(void);
+int cl_at24c32_twr(void);
 
 void lame_dump(uint8_t * address, uint32_t count);
 
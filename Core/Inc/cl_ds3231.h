@@ -22,6 +22,8 @@
 uint8_t bcd_to_bin(uint8_t bcd);
 uint8_t bin_to_bcd(uint8_t bin);
 int cl_ds_time_valid(void);
+int ds3231_read_registers(uint8_t reg, uint8_t * data, uint16_t count);
+int ds3231_write_registers(uint8_t reg, const uint8_t * data, uint16_t count);
 int cl_ds_time(void);
 int cl_ds_date(void);
 int cl_ds_time_stamp(void);
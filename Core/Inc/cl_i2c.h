@@ -18,19 +18,26 @@ extern "C" {
 
 #define I2C_ADDRESS_MIN	0x03
 #define I2C_ADDRESS_MAX 0x77
-#define I2C_SMALL_TIMEOUT  25  // More than enough time for 256 characters
+#define I2C_DUMP_MAX      256  // most registers displayed by i2cdump
 
 // Externs:
 extern I2C_HandleTypeDef hi2c1;
+extern struct I2C_BUS * cl_i2c_bus_selected;
 
 
 // Prototypes:
 int cl_i2c_validate_address(uint16_t i2c_address); // I2C helper function that validates I2C address is within range
 int cl_i2c_write_read(uint16_t i2c_address, uint8_t * pwrite, uint16_t wr_count, uint8_t * pread, uint16_t rd_count);
+int cl_i2c_present(uint16_t i2c_address);
 int cl_i2c_scan(void);
 int cl_i2c_dump(void);
 int cl_i2c_get(void);
 int cl_i2c_set(void);
+int cl_i2c_restart_bench(void);
+int cl_i2c_bus(void);
+int cl_i2c_read(void);
+int cl_i2c_write(void);
+int cl_i2c_speed(void);
 
 #endif // HAL_I2C_MODULE_ENABLED
 
@@ -34,8 +34,8 @@
 #define _LF  '\n'
 
 // Defines
-#define MAXWORDS 10     // support up to 10 (command and parameters)
-#define MAXSERIALBUF 64 // Our command line will use a 64 byte buffer
+#define MAXWORDS 24     // support up to 24 (command and parameters) - i2cwrite takes one per byte
+#define MAXSERIALBUF 128 // Our command line will use a 128 byte buffer
 
 // Externs
 extern char buffer[]; // holds command strings from user
@@ -50,6 +50,7 @@ int cl_parseArgcArgv(char * inBuf,char **words, int count);
 void cl_setup(void);
 void cl_loop(void);
 void cl_process_buffer(void);
+void cl_prompt(void);
 
 // command line functions
 int cl_help(void);
@@ -59,5 +60,7 @@ int cl_info(void);
 int cl_reset(void);
 int cl_timer(void);
 int cl_timer_delay_test(void);
+int cl_latency(void);
+int cl_cmd_bench(void);
 
 #endif // _command_line_h_
@@ -0,0 +1,37 @@
+// File: events.h
+//
+// Event flags for the main loop.  Interrupt handlers post events, main() sleeps until one arrives.
+//
+#ifndef _EVENTS_H_
+#define _EVENTS_H_
+
+#include <stdint.h> // uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Defines:
+// Set to 1 to run the original polled main loop (cl_loop() every 50ms), for latency comparison
+#define EVENT_LOOP_POLLED  0
+
+// Event flags, one bit each
+#define EVENT_UART_RX   (1UL<<0)  // characters received - serial.c
+#define EVENT_BUTTON    (1UL<<1)  // blue push button released - interrupt.c
+#define EVENT_TIMER     (1UL<<2)  // one-shot timer expired - event_timer_start()
+#define EVENT_TASK      (1UL<<3)  // a cooperative task is ready to run - task.c
+#define EVENT_BREAK     (1UL<<4)  // Ctrl-C received, cancel the foreground task - serial.c
+#define EVENT_I2C       (1UL<<5)  // an I2C bus is held for recovery - i2c_async.c
+
+// Prototypes:
+void event_post(uint32_t events);
+uint32_t event_get(void);
+uint32_t event_wait(void);
+void event_timer_start(uint32_t ms);
+void event_tick(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _EVENTS_H_ */
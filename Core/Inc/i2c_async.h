@@ -0,0 +1,150 @@
+// File: i2c_async.h
+//
+// Defines, typedefs, structures for i2c_async.c module - queued, interrupt driven I2C transactions on I2C1 and I2C2
+//
+#ifndef _I2C_ASYNC_H_
+#define _I2C_ASYNC_H_
+
+#include "main.h"          // HAL functions and defines
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// HAL_I2C_MODULE_ENABLED will be defined when an I2C interface is enabled within the ioc file
+#ifdef HAL_I2C_MODULE_ENABLED
+
+// Defines:
+// I2C_XFER status values
+#define I2C_XFER_DONE     0    // completed successfully
+#define I2C_XFER_QUEUED   1    // waiting for the bus
+#define I2C_XFER_ACTIVE   2    // on the bus
+#define I2C_XFER_ERROR    (-1) // NACK, bus error, arbitration lost - see I2C_XFER.error
+#define I2C_XFER_TIMEOUT  (-2) // i2c_transfer() gave up waiting, transaction aborted
+#define I2C_XFER_PEC      (-3) // transaction completed, SMBus PEC mismatch - see i2c_write_read_pec()
+
+// Time allowed for a blocking transaction, see i2c_timeout_ms()
+#define I2C_TIMEOUT_MARGIN    2      // multiple of the ideal time on the wire
+#define I2C_STRETCH_US        100    // clock stretching allowance, per byte
+#define I2C_TIMEOUT_MIN_MS    2      // covers 1ms tick granularity, STOP and bus free time
+
+// Longest i2c_bus_lock() waits for a bus's queue to drain
+#define I2C_LOCK_TIMEOUT_MS   100
+
+// Scatter-gather: most write segments in one transaction
+#define I2C_SEGMENTS_MAX      4
+
+// Per-device bus speed table
+#define I2C_SPEED_TABLE_SIZE  8
+#define I2C_SPEED_DEFAULT     100000 // SCL Hz for devices not in the table
+
+typedef struct I2C_XFER I2C_XFER;
+typedef struct I2C_BUS I2C_BUS;
+
+// Speed of one device on one bus - the same address on the other bus is a different device
+typedef struct {
+	const I2C_BUS * bus;         // bus the device is on
+	uint16_t address;            // 7-bit device address, 0 for an unused entry
+	uint32_t clock_speed;        // SCL Hz, up to 400000
+	uint32_t duty_cycle;         // I2C_DUTYCYCLE_2 or I2C_DUTYCYCLE_16_9 (fast mode only)
+} I2C_SPEED_ENTRY;
+
+typedef void (*I2C_XFER_CALLBACK)(I2C_XFER * x);
+
+// One piece of a gathered write, see i2c_xfer_init_segments()
+typedef struct {
+	const uint8_t * data;
+	uint16_t count;
+} I2C_SEGMENT;
+
+// Transaction descriptor: START, write span, repeated START, read span, STOP
+// Either span may be empty.  The write span is either pwrite, or a list of segments sent back to
+// back.  The descriptor, segment list and spans belong to the engine until the transaction
+// completes (status <= I2C_XFER_DONE), or i2c_cancel() takes them back.
+struct I2C_XFER {
+	uint16_t address;            // 7-bit device address
+	uint16_t wr_count;           // bytes to write, 0 for none - total of all segments
+	const uint8_t * pwrite;      // NULL when segments are used
+	const I2C_SEGMENT * segments;
+	uint8_t seg_count;           // 0 for pwrite
+	uint8_t seg_index;           // segment on the bus, i2c_async.c use only
+	uint8_t * pread;
+	uint16_t rd_count;           // bytes to read, 0 for none
+	I2C_XFER_CALLBACK callback;  // interrupt context, at completion - may be NULL
+	void * context;              // for the callback's use
+	volatile int8_t status;      // I2C_XFER_xxx
+	uint32_t error;              // HAL_I2C_ERROR_xxx bits, for I2C_XFER_ERROR
+	uint32_t start_us;           // timestamp_us() when the transaction started, for the trace
+	I2C_BUS * bus;               // bus the transaction was submitted to
+	I2C_XFER * next;             // queue link, i2c_async.c use only
+};
+
+// One I2C peripheral and its transaction queue
+#define I2C_BUS_COUNT  2
+
+struct I2C_BUS {
+	I2C_HandleTypeDef * hi2c;
+	const char * name;           // "I2C1"
+	GPIO_TypeDef * port;         // SCL and SDA pins, driven as GPIO by bus recovery
+	uint16_t scl_pin;
+	uint16_t sda_pin;
+	void (*init)(void);          // peripheral initialization, re-run by bus recovery
+	I2C_XFER * head;             // active transaction, NULL when idle
+	I2C_XFER * tail;
+	uint32_t transactions;       // completed, successfully or not
+	uint32_t failures;           // completed with I2C_XFER_ERROR or I2C_XFER_TIMEOUT
+	uint32_t last_error;         // most recent failure: HAL_I2C_ERROR_xxx bits,
+	int8_t last_status;          //   I2C_XFER_xxx status,
+	uint16_t last_address;       //   and device address
+	volatile uint8_t locked;     // held by a polled operation, see i2c_bus_trylock()
+	uint32_t locks;              // polled operations granted the bus
+	uint32_t contended;          // lock attempts that found the queue busy or the bus held
+	uint32_t deferred;           // transactions submitted while the bus was held, started at unlock
+	uint32_t deferred_since;     // timestamp_us() of the first transaction deferred by the current holder
+	uint32_t deferred_max_us;    // longest a deferred transaction waited for the holder
+	volatile uint8_t recover;    // I2C_RECOVER_xxx - held since a timeout or bus fault, see i2c_bus_service()
+};
+
+// Externs:
+extern I2C_HandleTypeDef hi2c1;
+extern I2C_HandleTypeDef hi2c2;
+extern I2C_BUS i2c_bus1;
+extern I2C_BUS i2c_bus2;
+extern I2C_BUS * const i2c_buses[I2C_BUS_COUNT];
+extern I2C_SPEED_ENTRY i2c_speed_table[I2C_SPEED_TABLE_SIZE];
+
+// Prototypes:
+int i2c_xfer_owned(const I2C_XFER * x);
+int i2c_xfer_init(I2C_XFER * x, uint16_t address, const uint8_t * pwrite, uint16_t wr_count, uint8_t * pread, uint16_t rd_count);
+int i2c_xfer_init_segments(I2C_XFER * x, uint16_t address, const I2C_SEGMENT * segments, uint8_t seg_count,
+		uint8_t * pread, uint16_t rd_count);
+uint32_t i2c_timeout_ms(const I2C_BUS * bus, uint16_t address, uint32_t bytes);
+int i2c_bus_submit(I2C_BUS * bus, I2C_XFER * x);
+int i2c_bus_transfer(I2C_BUS * bus, I2C_XFER * x, uint32_t timeout_ms);
+int i2c_bus_busy(const I2C_BUS * bus);
+int i2c_bus_trylock(I2C_BUS * bus);
+int i2c_bus_lock(I2C_BUS * bus, uint32_t timeout_ms);
+void i2c_bus_unlock(I2C_BUS * bus);
+int i2c_bus_probe(I2C_BUS * bus, uint16_t address);
+int i2c_bus_tryprobe(I2C_BUS * bus, uint16_t address);
+int i2c_bus_service(I2C_BUS * bus);
+void i2c_service(void);
+int i2c_wait(I2C_XFER * x, uint32_t timeout_ms);
+void i2c_cancel(I2C_XFER * x);
+int i2c_write_read(I2C_BUS * bus, uint16_t address, const uint8_t * pwrite, uint16_t wr_count, uint8_t * pread, uint16_t rd_count);
+int i2c_write_segments(I2C_BUS * bus, uint16_t address, const I2C_SEGMENT * segments, uint8_t seg_count);
+int i2c_write_read_pec(I2C_BUS * bus, uint16_t address, const uint8_t * pwrite, uint16_t wr_count, uint8_t * pread, uint16_t rd_count);
+int i2c_submit(I2C_XFER * x);
+int i2c_transfer(I2C_XFER * x, uint32_t timeout_ms);
+int i2c_async_busy(void);
+int i2c_speed_set(const I2C_BUS * bus, uint16_t address, uint32_t clock_speed, uint32_t duty_cycle);
+const I2C_SPEED_ENTRY * i2c_speed_lookup(const I2C_BUS * bus, uint16_t address);
+uint32_t i2c_scl_hz(uint32_t clock_speed, uint32_t duty_cycle);
+
+#endif // HAL_I2C_MODULE_ENABLED
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _I2C_ASYNC_H_ */
@@ -0,0 +1,44 @@
+// File: i2c_ll.h
+//
+// Defines and prototypes for i2c_ll.c module - register level I2C operations (RM0008, chapter 26)
+//
+#ifndef _I2C_LL_H_
+#define _I2C_LL_H_
+
+#include "main.h"          // HAL functions and defines
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// HAL_I2C_MODULE_ENABLED will be defined when an I2C interface is enabled within the ioc file
+#ifdef HAL_I2C_MODULE_ENABLED
+
+// Defines:
+#define I2C_LL_TIMEOUT_US   1000  // give up on a flag after 1ms - a probe normally takes about 100us at 100KHz
+
+// Build option: register level fast path for short blocking transactions on I2C1 (see i2c_write_read())
+// 0 - every transaction goes through the interrupt driven HAL engine
+#define I2C_LL_FAST_PATH    1
+#define I2C_LL_FAST_MAX     4     // most bytes (written + read) sent through the fast path
+
+// i2c_ll_probe() return values
+#define I2C_LL_ACK          1     // device acknowledged its address
+#define I2C_LL_NACK         0     // no device at this address
+#define I2C_LL_ERROR        (-1)  // peripheral or bus busy, bus error, arbitration lost, timeout
+
+// Prototypes:
+int i2c_ll_probe(I2C_HandleTypeDef * hi2c, uint16_t address);
+int i2c_ll_write_read(I2C_HandleTypeDef * hi2c, uint16_t address, const uint8_t * pwrite, uint16_t wr_count,
+		uint8_t * pread, uint16_t rd_count);
+int i2c_ll_write_read_pec(I2C_HandleTypeDef * hi2c, uint16_t address, const uint8_t * pwrite, uint16_t wr_count,
+		uint8_t * pread, uint16_t rd_count);
+int cl_i2c_ll_bench(void);
+
+#endif // HAL_I2C_MODULE_ENABLED
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _I2C_LL_H_ */
@@ -0,0 +1,48 @@
+// File: i2c_pec.h
+//
+// Defines, typedefs, structures for i2c_pec.c module - SMBus packet error checking (CRC-8)
+//
+#ifndef _I2C_PEC_H_
+#define _I2C_PEC_H_
+
+#include "main.h"          // HAL functions and defines
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// HAL_I2C_MODULE_ENABLED will be defined when an I2C interface is enabled within the ioc file
+#ifdef HAL_I2C_MODULE_ENABLED
+
+// Defines:
+#define I2C_PEC_POLY        0x07  // CRC-8, x^8 + x^2 + x + 1, initial value 0 (SMBus 2.0)
+#define I2C_PEC_DATA_MAX    33    // most bytes read with PEC - an SMBus block: count byte and 32 data bytes
+
+// Build option: let the peripheral's PEC calculator check transactions when the bus is free
+// (see i2c_write_read_pec()).  0 - always the table driven software CRC
+#define I2C_PEC_HARDWARE    1
+
+typedef struct {
+	uint32_t hardware;           // transactions checked by the peripheral
+	uint32_t software;           // transactions checked by table
+	uint32_t mismatches;         // device PEC differed from the calculated PEC
+} I2C_PEC_STATS;
+
+// Externs:
+extern I2C_PEC_STATS i2c_pec_stats;
+extern uint8_t i2c_pec_hardware;
+extern uint8_t i2c_pec_commands;
+
+// Prototypes:
+uint8_t i2c_pec_crc8(uint8_t crc, const uint8_t * data, uint16_t count);
+uint8_t i2c_pec_message(uint16_t address, const uint8_t * pwrite, uint16_t wr_count, const uint8_t * pread, uint16_t rd_count);
+void i2c_pec_record(uint8_t bus, uint16_t address, int hardware, int status);
+int cl_i2c_pec(void);
+
+#endif // HAL_I2C_MODULE_ENABLED
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _I2C_PEC_H_ */
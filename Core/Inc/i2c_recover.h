@@ -0,0 +1,50 @@
+// File: i2c_recover.h
+//
+// Defines, typedefs, structures for i2c_recover.c module - I2C bus lock-up detection and recovery
+//
+#ifndef _I2C_RECOVER_H_
+#define _I2C_RECOVER_H_
+
+#include "main.h"          // HAL functions and defines
+#include "i2c_async.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// HAL_I2C_MODULE_ENABLED will be defined when an I2C interface is enabled within the ioc file
+#ifdef HAL_I2C_MODULE_ENABLED
+
+// Defines:
+#define I2C_STUCK_US          1000 // BUSY held this long with no transaction in progress is a lock-up
+#define I2C_RECOVER_CLOCKS    9    // SCL pulses to release a slave holding SDA (one byte plus ACK)
+#define I2C_RECOVER_HALF_US   5    // half SCL period while clocking by hand, 100KHz
+
+// Recovery reasons
+#define I2C_RECOVER_MANUAL    0    // i2crecover command
+#define I2C_RECOVER_BUSY      1    // BUSY flag stuck while idle
+#define I2C_RECOVER_TIMEOUT   2    // transaction did not complete
+#define I2C_RECOVER_ERROR     3    // bus error, or peripheral left in a bad state
+#define I2C_RECOVER_REASONS   4
+
+typedef struct {
+	uint32_t count[I2C_RECOVER_REASONS]; // recoveries, by reason
+	uint32_t sda_stuck;      // recoveries that found SDA held low
+	uint32_t failed;         // recoveries that could not free the bus
+	uint32_t last_us;        // time taken by the most recent recovery
+	uint32_t max_us;         // worst case time to recover
+	uint32_t last_tick;      // HAL_GetTick() of the most recent recovery
+} I2C_RECOVER_STATS;
+
+// Prototypes:
+int i2c_bus_stuck(I2C_BUS * bus);
+int i2c_bus_recover(I2C_BUS * bus, uint8_t reason);
+int cl_i2c_recover(void);
+
+#endif // HAL_I2C_MODULE_ENABLED
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _I2C_RECOVER_H_ */
@@ -0,0 +1,52 @@
+// File: i2c_registry.h
+//
+// Defines, typedefs, structures for i2c_registry.c module - cached I2C device presence
+//
+#ifndef _I2C_REGISTRY_H_
+#define _I2C_REGISTRY_H_
+
+#include "main.h"          // HAL functions and defines
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// HAL_I2C_MODULE_ENABLED will be defined when an I2C interface is enabled within the ioc file
+#ifdef HAL_I2C_MODULE_ENABLED
+
+// Defines:
+#define I2C_REGISTRY_SIZE      8     // devices tracked, least recently updated entry is replaced
+#define I2C_REGISTRY_STALE_MS  10000 // re-probe a present device not heard from in this long
+
+// I2C_DEVICE.state
+#define I2C_DEVICE_UNKNOWN     0     // bus error or never seen - probe before use
+#define I2C_DEVICE_PRESENT     1     // acknowledged its address
+#define I2C_DEVICE_ABSENT      2     // address was not acknowledged
+
+typedef struct {
+	uint16_t address;      // 7-bit device address, 0 for an unused entry
+	uint8_t state;         // I2C_DEVICE_xxx
+	uint32_t last_seen;    // HAL_GetTick() of the most recent acknowledge
+	uint32_t last_update;  // HAL_GetTick() of the most recent transaction or probe
+} I2C_DEVICE;
+
+typedef struct {
+	uint32_t hits;         // i2c_device_present() answered from the registry
+	uint32_t misses;       // i2c_device_present() had to probe - stale, unknown, or after an error
+	uint32_t learned_ack;  // transactions that confirmed a device present
+	uint32_t learned_nack; // transactions that found a device missing
+	uint32_t learned_error;// transactions that ended with a bus error
+} I2C_REGISTRY_STATS;
+
+// Prototypes:
+void i2c_registry_update(uint16_t address, uint8_t state);
+int i2c_device_present(uint16_t address);
+int cl_i2c_registry(void);
+
+#endif // HAL_I2C_MODULE_ENABLED
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _I2C_REGISTRY_H_ */
@@ -0,0 +1,53 @@
+// File: i2c_stats.h
+//
+// Defines, typedefs, structures for i2c_stats.c module - per device I2C statistics
+//
+#ifndef _I2C_STATS_H_
+#define _I2C_STATS_H_
+
+#include "main.h"          // HAL functions and defines
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// HAL_I2C_MODULE_ENABLED will be defined when an I2C interface is enabled within the ioc file
+#ifdef HAL_I2C_MODULE_ENABLED
+
+// Defines:
+#define I2C_STATS_SLOTS    8   // devices tracked, others are summed in one overflow slot
+#define I2C_STATS_BUCKETS  16  // latency histogram, bucket n counts [2^n, 2^(n+1)) us, bucket 0 includes 0
+
+// i2c_stats_record() outcome
+#define I2C_STATS_OK       0
+#define I2C_STATS_NACK     1
+#define I2C_STATS_TIMEOUT  2
+#define I2C_STATS_BUS_ERROR 3
+
+typedef struct {
+	uint8_t used;              // slot allocated - address 0x00 (general call) is a device like any other
+	uint8_t bus;               // 0 for I2C1, 1 for I2C2
+	uint16_t address;          // 7-bit device address, 0xFFFF for the overflow slot
+	uint32_t transactions;
+	uint32_t bytes_written;
+	uint32_t bytes_read;
+	uint32_t nacks;
+	uint32_t timeouts;
+	uint32_t bus_errors;
+	uint32_t pec_errors;       // SMBus PEC mismatches, see i2c_stats_pec_mismatch()
+	uint32_t busy_us;          // total transaction time - bus occupancy
+	uint16_t histogram[I2C_STATS_BUCKETS]; // saturating counts
+} I2C_ADDRESS_STATS;
+
+// Prototypes:
+void i2c_stats_record(uint8_t bus, uint16_t address, uint16_t wr_count, uint16_t rd_count, uint8_t outcome, uint32_t duration_us);
+void i2c_stats_pec_mismatch(uint8_t bus, uint16_t address);
+int cl_i2c_stats(void);
+
+#endif // HAL_I2C_MODULE_ENABLED
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _I2C_STATS_H_ */
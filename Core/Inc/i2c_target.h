@@ -0,0 +1,53 @@
+// File: i2c_target.h
+//
+// Defines, typedefs, structures for i2c_target.c module - I2C1 or I2C2 as a target (slave),
+// emulating an AT24C32 or DS3231 from RAM
+//
+#ifndef _I2C_TARGET_H_
+#define _I2C_TARGET_H_
+
+#include "main.h"          // HAL functions and defines
+#include "i2c_async.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// HAL_I2C_MODULE_ENABLED will be defined when an I2C interface is enabled within the ioc file
+#ifdef HAL_I2C_MODULE_ENABLED
+
+// Defines:
+#define I2C_TARGET_DS3231_REGS  0x13   // DS3231 registers 0x00 - 0x12, the register pointer wraps to 0x00
+#define I2C_TARGET_BUS_DEFAULT  2      // I2C1 already has a real AT24C32 and DS3231 on the Nucleo
+
+// Emulated devices, see i2c_target_devices[]
+#define I2C_TARGET_AT24C32      0
+#define I2C_TARGET_DS3231       1
+
+typedef struct {
+	uint32_t transactions;       // times addressed
+	uint32_t tx_bytes;           // bytes served to the master
+	uint32_t rx_bytes;           // bytes received from the master, address pointer and data
+	uint32_t overruns;           // OVR - a byte received before the previous one was read, or sent
+	                             //   again because the next was not loaded in time (no clock stretching)
+	uint32_t errors;             // misplaced START / STOP (BERR)
+	uint32_t isr_max_cycles;     // longest event interrupt, CPU cycles
+} I2C_TARGET_STATS;
+
+// Externs:
+extern I2C_TARGET_STATS i2c_target_stats;
+
+// Prototypes:
+int i2c_target_start(I2C_BUS * bus, uint8_t device);
+void i2c_target_stop(void);
+int i2c_target_event(I2C_HandleTypeDef * hi2c);
+int i2c_target_error(I2C_HandleTypeDef * hi2c);
+int cl_i2c_target(void);
+
+#endif // HAL_I2C_MODULE_ENABLED
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _I2C_TARGET_H_ */
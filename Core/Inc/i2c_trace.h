@@ -0,0 +1,48 @@
+// File: i2c_trace.h
+//
+// Defines, typedefs, structures for i2c_trace.c module - I2C transaction trace buffer
+//
+#ifndef _I2C_TRACE_H_
+#define _I2C_TRACE_H_
+
+#include "main.h"          // HAL functions and defines
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// HAL_I2C_MODULE_ENABLED will be defined when an I2C interface is enabled within the ioc file
+#ifdef HAL_I2C_MODULE_ENABLED
+
+// Defines:
+#define I2C_TRACE_SIZE   64   // entries, power of 2 - oldest entries are overwritten
+#define I2C_TRACE_DATA   4    // leading data bytes kept per entry
+
+// I2C_TRACE_ENTRY.flags
+#define I2C_TRACE_PROBE  0x01 // address only probe (i2c_ll.c)
+#define I2C_TRACE_BUS2   0x02 // transaction on I2C2 (else I2C1)
+
+typedef struct {
+	uint32_t timestamp;       // timestamp_us() at the start of the transaction
+	uint16_t duration;        // micro-seconds, 0xFFFF if longer
+	uint16_t wr_count;        // bytes written
+	uint16_t rd_count;        // bytes read
+	uint8_t address;          // 7-bit device address
+	uint8_t flags;            // I2C_TRACE_xxx
+	int8_t status;            // I2C_XFER_xxx - a probe NACK is I2C_XFER_ERROR, error HAL_I2C_ERROR_AF
+	uint8_t error;            // HAL_I2C_ERROR_xxx bits (low byte)
+	uint8_t data[I2C_TRACE_DATA]; // first bytes written, else first bytes read
+} I2C_TRACE_ENTRY;            // 20 bytes
+
+// Prototypes:
+void i2c_trace_record(uint32_t start_us, uint16_t address, uint8_t flags, const uint8_t * pwrite, uint16_t wr_count,
+		const uint8_t * pread, uint16_t rd_count, int8_t status, uint32_t error);
+int cl_i2c_trace(void);
+
+#endif // HAL_I2C_MODULE_ENABLED
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _I2C_TRACE_H_ */
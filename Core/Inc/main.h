@@ -41,7 +41,10 @@ extern "C" {
 
 /* Exported constants --------------------------------------------------------*/
 /* USER CODE BEGIN EC */
-
+// NVIC pre-emption priorities (NVIC_PRIORITYGROUP_4, lower is more urgent).  A bus in target mode
+// runs without clock stretching, so while it is active its interrupts pre-empt all others.
+#define IRQ_PRIORITY_TARGET   0  // I2C target event / error, see i2c_target_start()
+#define IRQ_PRIORITY_DEFAULT  1  // every other peripheral interrupt
 /* USER CODE END EC */
 
 /* Exported macro ------------------------------------------------------------*/
@@ -53,6 +56,8 @@ extern "C" {
 void Error_Handler(void);
 
 /* USER CODE BEGIN EFP */
+void i2c1_reinit(void);
+void i2c2_init(void);
 
 /* USER CODE END EFP */
 
@@ -0,0 +1,42 @@
+// File: ring_buffer.h
+//
+// Single producer / single consumer byte ring buffer.
+// The producer only writes "head", the consumer only writes "tail", so one side may live in an
+// interrupt handler without locking.  This module has no HAL dependencies, allowing it to be
+// compiled and exercised on a Linux host.
+
+#ifndef _RING_BUFFER_H_
+#define _RING_BUFFER_H_
+
+#include <stdint.h> // uint8_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Prevent the compiler from moving buffer accesses across head/tail updates
+#define RING_BARRIER()  __asm volatile ("" ::: "memory")
+
+typedef struct {
+	uint8_t * buf;            // storage, size bytes
+	uint16_t size;            // must be a power of 2, no larger than 32768
+	volatile uint16_t head;   // free running index, next byte to write (producer)
+	volatile uint16_t tail;   // free running index, next byte to read (consumer)
+	uint16_t high_water;      // most bytes ever held in the buffer
+} RING_BUFFER;
+
+// Prototypes:
+void ring_init(RING_BUFFER * r, uint8_t * buf, uint16_t size);
+uint16_t ring_count(const RING_BUFFER * r);
+uint16_t ring_space(const RING_BUFFER * r);
+int ring_put(RING_BUFFER * r, uint8_t c);
+int ring_get(RING_BUFFER * r);
+uint16_t ring_write(RING_BUFFER * r, const uint8_t * data, uint16_t count);
+uint16_t ring_linear(const RING_BUFFER * r, uint8_t ** pdata);
+void ring_advance(RING_BUFFER * r, uint16_t count);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _RING_BUFFER_H_ */
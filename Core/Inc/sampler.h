@@ -0,0 +1,61 @@
+// File: sampler.h
+//
+// Defines, typedefs, structures for sampler.c module - TIM3 paced background register reads on I2C1
+//
+#ifndef _SAMPLER_H_
+#define _SAMPLER_H_
+
+#include "main.h"          // HAL functions and defines
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// HAL_I2C_MODULE_ENABLED will be defined when an I2C interface is enabled within the ioc file
+#ifdef HAL_I2C_MODULE_ENABLED
+
+// Defines:
+#define SAMPLER_READS_MAX     4      // register reads issued at each tick
+#define SAMPLER_DATA_MAX      7      // bytes per read, keeps a SAMPLE at 16 bytes
+#define SAMPLER_RING_SIZE     512    // bytes, power of 2 - 32 samples
+#define SAMPLER_RATE_MAX      1000   // Hz
+#define SAMPLER_PERIOD_MAX_US 50000  // longest TIM3 period, slower rates count several periods
+
+// One completed read, as held in the ring buffer
+typedef struct {
+	uint32_t timestamp;          // timestamp_us() of the timer tick that issued the read
+	uint16_t tick;               // tick number (low 16 bits), groups the reads of one tick
+	uint8_t index;               // entry in the read list
+	int8_t status;               // I2C_XFER_DONE or I2C_XFER_ERROR
+	uint8_t count;               // bytes in data[]
+	uint8_t data[SAMPLER_DATA_MAX];
+} SAMPLE;
+
+typedef struct {
+	uint32_t ticks;              // timer ticks at the sample rate
+	uint32_t missed;             // ticks skipped - the previous tick's reads were still on the bus
+	uint32_t samples;            // reads completed
+	uint32_t errors;             // reads completed with an error
+	uint32_t overruns;           // samples lost - ring buffer full
+	uint16_t latency_min;        // timer update event to tick handler, us
+	uint16_t latency_max;
+	uint32_t busy_max;           // tick to last read of the tick complete, us
+} SAMPLER_STATS;
+
+// Externs:
+extern TIM_HandleTypeDef htim3;
+extern SAMPLER_STATS sampler_stats;
+
+// Prototypes:
+void sampler_tick(void);
+int sampler_start(uint32_t rate_hz);
+void sampler_stop(void);
+int cl_sample(void);
+
+#endif // HAL_I2C_MODULE_ENABLED
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _SAMPLER_H_ */
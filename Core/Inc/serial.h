@@ -0,0 +1,50 @@
+// File: serial.h
+//
+// Defines, typedefs, structures for serial.c module - USART2 console I/O
+//
+#ifndef _SERIAL_H_
+#define _SERIAL_H_
+
+#include "main.h"          // HAL functions and defines
+#include "ring_buffer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Defines:
+#define SERIAL_TX_BUFFER_SIZE  1024  // power of 2 - a full 80x24 VT100 screen is about 2K
+#define SERIAL_RX_BUFFER_SIZE  512   // power of 2 - holds a pasted script while a command runs
+#define SERIAL_RX_DMA_SIZE     64    // circular DMA buffer, half transfer interrupt every 32 bytes
+#define SERIAL_TX_LOCK_BYTES   64    // most bytes appended to the transmit ring with interrupts masked
+#define SERIAL_CTRL_C          0x03  // posts EVENT_BREAK on arrival
+
+typedef struct {
+	uint32_t tx_transfers; // DMA transfers started
+	uint32_t tx_overflow;  // times a character found the transmit buffer full
+	uint32_t tx_dropped;   // characters discarded - buffer full while unable to wait (ISR context), DMA error
+	uint32_t rx_overrun;   // characters lost - receive buffer full
+	uint32_t rx_hw_overrun;// characters lost - USART overrun (ORE)
+	uint32_t rx_errors;    // parity, noise, framing errors
+	uint32_t rx_starts;    // receive DMA (re)starts
+} SERIAL_STATS;
+
+// Externs:
+extern UART_HandleTypeDef huart2;
+extern DMA_HandleTypeDef hdma_usart2_tx;
+extern DMA_HandleTypeDef hdma_usart2_rx;
+extern RING_BUFFER serial_tx_ring;
+extern RING_BUFFER serial_rx_ring;
+extern SERIAL_STATS serial_stats;
+extern volatile uint32_t serial_rx_timestamp;
+
+// Prototypes:
+void serial_init(void);
+void serial_flush(void);
+int cl_serial_stats(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _SERIAL_H_ */
@@ -58,6 +58,15 @@ void SysTick_Handler(void);
 void TIM1_UP_IRQHandler(void);
 void EXTI15_10_IRQHandler(void);
 /* USER CODE BEGIN EFP */
+void TIM2_IRQHandler(void);
+void TIM3_IRQHandler(void);
+void USART2_IRQHandler(void);
+void DMA1_Channel6_IRQHandler(void);
+void DMA1_Channel7_IRQHandler(void);
+void I2C1_EV_IRQHandler(void);
+void I2C1_ER_IRQHandler(void);
+void I2C2_EV_IRQHandler(void);
+void I2C2_ER_IRQHandler(void);
 
 /* USER CODE END EFP */
 
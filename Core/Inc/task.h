@@ -0,0 +1,95 @@
+// File: task.h
+//
+// Cooperative, stackless tasks (protothread style) for commands that take a long time.
+//
+// A task function is called repeatedly by task_run() from the main loop.  Each call resumes where
+// the previous call yielded, using a switch statement on the line number of the yield point.
+// Since the function returns at each yield, local (stack) variables do NOT survive a yield - keep
+// state in a static structure that embeds the TASK.  Also, don't use the macros inside another
+// switch statement, and don't put two of them on one source line.
+//
+// Example:
+//   static struct { TASK task; int count; } blink;
+//   static int blink_task(TASK * t) {
+//       TASK_BEGIN(t);
+//       for(blink.count=0; blink.count<10; blink.count++) {
+//           HAL_GPIO_TogglePin(LD2_GPIO_Port, LD2_Pin);
+//           TASK_DELAY(t, 500);
+//       }
+//       TASK_ON_CANCEL(t); // code below runs at the end, and when cancelled (Ctrl-C)
+//       HAL_GPIO_WritePin(LD2_GPIO_Port, LD2_Pin, GPIO_PIN_RESET);
+//       TASK_END(t);
+//   }
+//   task_start(&blink.task, blink_task, "blink");
+//
+#ifndef _TASK_H_
+#define _TASK_H_
+
+#include "main.h"          // HAL_GetTick()
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Defines:
+#define TASK_MAX          4       // tasks that may be active at once
+#define TASK_RUNNING      0       // task function return values
+#define TASK_DONE         1
+#define TASK_CANCEL_LINE  0xFFFF  // resume point used to run the TASK_ON_CANCEL() section
+
+typedef struct TASK TASK;
+typedef int (*TASK_FUNCTION)(TASK * t);
+
+struct TASK {
+	TASK_FUNCTION function;
+	const char * name;
+	uint16_t line;           // resume point, 0 to start
+	uint8_t delaying;        // non-zero while waiting in TASK_DELAY()
+	uint8_t waiting;         // non-zero while waiting in TASK_WAIT_EVENT()
+	uint8_t foreground;      // started by a command - holds the command prompt until done
+	volatile uint8_t cancel; // set by task_cancel()
+	uint32_t wake_tick;      // HAL_GetTick() value that ends TASK_DELAY()
+};
+
+#define TASK_BEGIN(t)   switch((t)->line) { case 0:
+#define TASK_END(t)     } (t)->line = 0; return TASK_DONE
+
+// Give other tasks and the main loop a turn, resume as soon as possible
+#define TASK_YIELD(t) \
+	do { (t)->line = __LINE__; return TASK_RUNNING; case __LINE__:; } while(0)
+
+// Return to the main loop until cond is true - cond is evaluated each time the task runs
+#define TASK_WAIT_UNTIL(t, cond) \
+	do { (t)->line = __LINE__; case __LINE__: if(!(cond)) return TASK_RUNNING; } while(0)
+
+// Sleep until an interrupt posts EVENT_TASK and cond is true (I2C completion, for example)
+// Unlike TASK_WAIT_UNTIL(), the main loop may WFI in the meantime
+#define TASK_WAIT_EVENT(t, cond) \
+	do { (t)->waiting = 1; TASK_WAIT_UNTIL(t, cond); (t)->waiting = 0; } while(0)
+
+// Sleep for ms milliseconds - the main loop may WFI while all tasks are delaying
+#define TASK_DELAY(t, ms) \
+	do { (t)->wake_tick = HAL_GetTick() + (ms); (t)->delaying = 1; \
+		TASK_WAIT_UNTIL(t, (int32_t)(HAL_GetTick() - (t)->wake_tick) >= 0); \
+		(t)->delaying = 0; } while(0)
+
+// End the task now (the TASK_ON_CANCEL() section is skipped)
+#define TASK_EXIT(t)    do { (t)->line = 0; return TASK_DONE; } while(0)
+
+// Start of clean-up code, run when the task falls through to it, or when cancelled
+#define TASK_ON_CANCEL(t)  case TASK_CANCEL_LINE:
+
+// Prototypes:
+int task_start(TASK * t, TASK_FUNCTION function, const char * name);
+int task_start_background(TASK * t, TASK_FUNCTION function, const char * name);
+void task_cancel(TASK * t);
+void task_cancel_foreground(void);
+int task_foreground_busy(void);
+void task_run(void);
+int cl_tasks(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _TASK_H_ */
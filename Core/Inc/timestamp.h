@@ -0,0 +1,30 @@
+// File: timestamp.h
+//
+// 32-bit microsecond time stamps built from the 16-bit TIM2 counter (1MHz) and its overflow interrupt
+// CPU cycle counts from the Cortex-M3 DWT cycle counter, for timing short code sequences
+//
+#ifndef _TIMESTAMP_H_
+#define _TIMESTAMP_H_
+
+#include "main.h"          // HAL functions and defines
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Current CPU cycle count (72MHz, wraps every 59.6 seconds)
+#define timestamp_cycles()  (DWT->CYCCNT)
+
+// Externs:
+extern TIM_HandleTypeDef htim2;
+
+// Prototypes:
+void timestamp_init(void);
+void timestamp_overflow(void);
+uint32_t timestamp_us(void);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* _TIMESTAMP_H_ */
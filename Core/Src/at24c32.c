@@ -7,14 +7,131 @@
 #include "command_line.h"
 #include "at24c32.h"
 #include "cl_i2c.h"
-#include <string.h> // memcpy()
+#include "task.h"
+#include "timestamp.h"
+#include "serial.h"
+#include "i2c_async.h"
+#include "i2c_ll.h"
+#include <string.h> // strlen(), memcmp()
+
+/* To implement the expected functionality, the following lines would be added to
+   command_line.c, in the cmd_table[]:
+
+	{"attwr",     "at24c32 write cycle times <reset>",            1, cl_at24c32_twr},
+
+*/
+
+// Write cycle completion:
+// After the STOP that ends a page write, the device is busy programming for up to tWR (10ms max,
+// often much less) and does not acknowledge its address.  Rather than always waiting 10ms, poll the
+// device address until it ACKs, bounded by AT24C32_WRITE_TIMEOUT_US.  Each poll is a START, address,
+// STOP sequence - about 100us at 100KHz, see i2c_ll_probe().  Only a NACK means the device is still
+// writing; a poll that finds I2C1 held or queued (sampler reads, for example) tells nothing, and is
+// retried without counting against the timeout - unless the bus stays busy beyond I2C_LOCK_TIMEOUT_MS.
+static uint32_t at24c32_write_start; // timestamp_us() at the end of the most recent page write
+
+// Measured write cycle times (micro-seconds)
+static struct {
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint32_t total;
+	uint32_t polls;
+	uint32_t bus_busy;   // polls skipped - bus held, queued work, or a bus error
+	uint32_t timeouts;
+} at24c32_twr = {0, UINT32_MAX, 0, 0, 0, 0, 0};
+
+// Return the number of bytes (up to count) that may be written at address without crossing a page boundary
+uint16_t at24c32_page_bytes(uint16_t address, uint16_t count)
+{
+	uint16_t next_page_boundary = (address + AT24C32_PAGE_WRITE_SIZE) & ~(AT24C32_PAGE_WRITE_SIZE-1);
+	uint16_t bytes_this_page = next_page_boundary - address;
+	return count < bytes_this_page? count:bytes_this_page;
+}
+
+// I2C completion callback (interrupt context) - the page write's STOP starts the write cycle
+static void at24c32_page_done(I2C_XFER * x)
+{
+	(void)x;
+	at24c32_write_start = timestamp_us();
+}
+
+// Prepare a "Page Write" transaction: the storage address and the caller's data are sent as two
+// segments of one write, so the data is not copied - count must not cross a page boundary, see
+// at24c32_page_bytes().  The data must stay in place until the transaction completes.
+// Return 0, or -1 if the page's previous transaction is still queued or on the bus
+int at24c32_page_xfer(AT24C32_PAGE * page, uint16_t address, const uint8_t * data, uint16_t count)
+{
+	if(i2c_xfer_owned(&page->xfer)) return -1; // its address and segments are still in use
+	page->addr[0] = (uint8_t) (address >> 8); // address, high byte
+	page->addr[1] = (uint8_t) address; // address, low byte
+	page->seg[0].data = page->addr;
+	page->seg[0].count = 2;
+	page->seg[1].data = data;
+	page->seg[1].count = count;
+	if(i2c_xfer_init_segments(&page->xfer, I2C_ADDRESS_AT24C32, page->seg, 2, NULL, 0)) return -1;
+	page->xfer.callback = at24c32_page_done;
+	return 0;
+}
+
+// Write one page - count must not cross a page boundary, see at24c32_page_bytes()
+// The device then needs up to 10ms to complete the write, before it will respond again.
+int at24c32_write_page(uint16_t address, const uint8_t * data, uint16_t count)
+{
+	AT24C32_PAGE page;
+
+	int rc = at24c32_page_xfer(&page, address, data, count);
+	if(!rc) rc = i2c_transfer(&page.xfer, i2c_timeout_ms(&i2c_bus1, I2C_ADDRESS_AT24C32, count+2));
+	if(rc) {
+		printf("Error writing at24c32\n");
+	}
+	return rc;
+}
+
+// Poll once for completion of the write cycle started by at24c32_write_page()
+// Return AT24C32_READY (write complete), AT24C32_BUSY (still writing), or AT24C32_TIMEOUT
+int at24c32_write_poll(void)
+{
+	int rc = i2c_bus_tryprobe(&i2c_bus1, I2C_ADDRESS_AT24C32); // at the device's SCL speed
+	uint32_t elapsed = timestamp_us() - at24c32_write_start;
+	if(rc == I2C_LL_ERROR) {
+		// No answer either way - try again, unless the bus never comes free
+		at24c32_twr.bus_busy++;
+		if(elapsed <= AT24C32_WRITE_TIMEOUT_US + I2C_LOCK_TIMEOUT_MS * 1000) return AT24C32_BUSY;
+		at24c32_twr.timeouts++;
+		printf("at24c32 write poll: I2C1 busy\n");
+		return AT24C32_TIMEOUT;
+	}
+	at24c32_twr.polls++;
+	if(rc == I2C_LL_ACK) {
+		at24c32_twr.count++;
+		at24c32_twr.total += elapsed;
+		if(elapsed < at24c32_twr.min) at24c32_twr.min = elapsed;
+		if(elapsed > at24c32_twr.max) at24c32_twr.max = elapsed;
+		return AT24C32_READY;
+	}
+	if(elapsed > AT24C32_WRITE_TIMEOUT_US) {
+		at24c32_twr.timeouts++;
+		printf("at24c32 write cycle timeout\n");
+		return AT24C32_TIMEOUT;
+	}
+	return AT24C32_BUSY;
+}
+
+// Wait (ACK polling) for the write cycle started by at24c32_write_page() to complete
+// Return 0 for success
+int at24c32_write_wait(void)
+{
+	int rc;
+	while(AT24C32_BUSY == (rc = at24c32_write_poll())) ;
+	return rc;
+}
 
 // Write array of bytes to the at24c32 device, using "Page Write" method (up to 32 bytes of data written with one start and one stop).
 // Note: This function checks and manages address wrap that occurs on 32-byte boundaries
-int at24c32_write(uint16_t address, uint8_t * data, uint16_t count)
+int at24c32_write(uint16_t address, const uint8_t * data, uint16_t count)
 {
 	int rc = 0;
-	uint8_t buf[34]; // hold two bytes for storage address, and up to 32 bytes of data (page write)
 
 	if(count > AT24C32_BYTE_COUNT) {
 		printf("%s: count > %u\n",__func__,AT24C32_BYTE_COUNT);
@@ -22,41 +139,30 @@ int at24c32_write(uint16_t address, uint8_t * data, uint16_t count)
 	}
 	while(count) {
 		// Using the address provided, determine number of bytes we can write for the current page
-		uint16_t next_page_boundary = (address + AT24C32_PAGE_WRITE_SIZE) & ~(AT24C32_PAGE_WRITE_SIZE-1);
-		uint16_t bytes_this_page = next_page_boundary - address;
-		uint16_t this_pass = count < bytes_this_page? count:bytes_this_page; // most bytes we can write for this pass
-
-		// prepare for write - load up buf
-		buf[0] = (uint8_t) (address >> 8); // address, high byte
-		buf[1] = (uint8_t) address; // address, low byte
-		memcpy(&buf[2],data,this_pass);
-		rc = cl_i2c_write_read(I2C_ADDRESS_AT24C32, buf, this_pass+2, NULL, 0);
-		if(rc) {
-			printf("Error writing at24c32\n");
-		}
+		uint16_t this_pass = at24c32_page_bytes(address, count); // most bytes we can write for this pass
+		rc = at24c32_write_page(address, data, this_pass);
+		if(rc) return rc;
 		// update for next pass
 		address+=this_pass;
 		data+=this_pass;
 		count-=this_pass;
-		HAL_Delay(10); // require some delay for write to complete
+		rc = at24c32_write_wait(); // poll for write cycle completion
+		if(rc) return rc;
 	} // while-loop
 	return rc;
 }
 
 // Read array of bytes from the at24c32 device.
+// One transaction: address write, repeated START, then a sequential read of count bytes.
 // Note: For device reads, address wrap will occur at the end of physical device storage
 int at24c32_read(uint16_t address, uint8_t * data, uint16_t count)
 {
 	uint8_t addr[2]; // hold two bytes for storage address
 
-//	if(count > 32) {
-//		printf("%s: count > 32\n",__func__);
-//		return 1;
-//	}
 	// Write address to begin reading
 	addr[0] = (uint8_t) (address >> 8); // address, high byte
 	addr[1] = (uint8_t) address; // address, low byte
-	int rc = cl_i2c_write_read(I2C_ADDRESS_AT24C32, addr, 2, data, count);
+	int rc = i2c_write_read(&i2c_bus1, I2C_ADDRESS_AT24C32, addr, 2, data, count);
 	if(rc) {
 		printf("Error reading at24c32\n");
 	}
@@ -82,25 +188,97 @@ void lame_dump(uint8_t * address, uint32_t count)
 #endif
 
 void hexdump(const void* address, unsigned size); // hexdump.c
+void hexdump_addr(const void* address, unsigned count, unsigned displayaddr); // hexdump.c
+
+// Streaming read, used by atread and atdump:
+// The device is read in spans of AT24C32_STREAM_SPAN bytes, each a single sequential read transaction
+// queued to the interrupt driven I2C engine.  Two span buffers alternate: while one span's hexdump
+// is formatted and queued for DMA output (serial.c), the next span is already being read.
+// The task sleeps while a read is in progress, or the transmit buffer lacks room for a span's hexdump.
+#define AT24C32_STREAM_SPAN  128
+#define AT24C32_STREAM_TEXT  (AT24C32_STREAM_SPAN/16*80) // hexdump output, 80 characters per 16 bytes
 
-// command line method to display <argument 1> count or 32 bytes from the device
+static struct {
+	TASK task;
+	uint16_t address;    // next address to read
+	uint16_t remaining;  // bytes not yet requested
+	uint8_t active;      // span being displayed
+	uint8_t next;        // non-zero if the other span has been requested
+	struct {
+		I2C_XFER xfer;
+		uint16_t address;
+		uint8_t addr[2];
+		uint8_t buf[AT24C32_STREAM_SPAN];
+	} span[2];
+} at24c32_stream;
+
+// Request the next span into at24c32_stream.span[i], return 0 for success
+static int at24c32_stream_read(int i)
+{
+	if(i2c_xfer_owned(&at24c32_stream.span[i].xfer)) return -1; // previous read still queued or on the bus
+	uint16_t this_pass = at24c32_stream.remaining < AT24C32_STREAM_SPAN? at24c32_stream.remaining:AT24C32_STREAM_SPAN;
+	at24c32_stream.span[i].address = at24c32_stream.address;
+	at24c32_stream.span[i].addr[0] = (uint8_t) (at24c32_stream.address >> 8); // address, high byte
+	at24c32_stream.span[i].addr[1] = (uint8_t) at24c32_stream.address; // address, low byte
+	i2c_xfer_init(&at24c32_stream.span[i].xfer, I2C_ADDRESS_AT24C32, at24c32_stream.span[i].addr, 2,
+			at24c32_stream.span[i].buf, this_pass);
+	// update for next pass, the device wraps to address 0 after the last byte
+	at24c32_stream.address = (at24c32_stream.address + this_pass) & (AT24C32_BYTE_COUNT-1);
+	at24c32_stream.remaining -= this_pass;
+	return i2c_submit(&at24c32_stream.span[i].xfer);
+}
+
+static int at24c32_stream_task(TASK * t)
+{
+	TASK_BEGIN(t);
+	at24c32_stream.active = 0;
+	if(!at24c32_stream.remaining || at24c32_stream_read(0)) TASK_EXIT(t);
+	while(1) {
+		TASK_WAIT_EVENT(t, at24c32_stream.span[at24c32_stream.active].xfer.status <= I2C_XFER_DONE);
+		if(at24c32_stream.span[at24c32_stream.active].xfer.status) {
+			printf("Error reading at24c32\n");
+			TASK_EXIT(t);
+		}
+		// Start reading the next span, then display this one
+		at24c32_stream.next = 0;
+		if(at24c32_stream.remaining) {
+			if(at24c32_stream_read(at24c32_stream.active ^ 1)) TASK_EXIT(t);
+			at24c32_stream.next = 1;
+		}
+		while(ring_space(&serial_tx_ring) < AT24C32_STREAM_TEXT)
+			TASK_DELAY(t, 1);
+		hexdump_addr(at24c32_stream.span[at24c32_stream.active].buf, at24c32_stream.span[at24c32_stream.active].xfer.rd_count,
+				at24c32_stream.span[at24c32_stream.active].address);
+		if(!at24c32_stream.next) break;
+		at24c32_stream.active ^= 1;
+	} // while-loop
+	TASK_ON_CANCEL(t);
+	// Ctrl-C: take back any span still queued or on the bus before the buffers are reused
+	i2c_cancel(&at24c32_stream.span[0].xfer);
+	i2c_cancel(&at24c32_stream.span[1].xfer);
+	TASK_END(t);
+}
+
+// Start streaming count bytes from address to the terminal
+static int at24c32_stream_start(uint16_t address, uint16_t count, const char * name)
+{
+	at24c32_stream.address = address & (AT24C32_BYTE_COUNT-1);
+	at24c32_stream.remaining = count;
+	return task_start(&at24c32_stream.task, at24c32_stream_task, name);
+}
+
+// command line method to display <argument 1> count or 32 bytes from the device, starting at <argument 2> address or 0
+// Expect: "atread <count> <address>"
 int cl_read_at24c32(void) {
-	int rc = 0;
 	uint16_t count = 32;
+	uint16_t address = 0;
     if(argc > 1) {
     	count = (uint16_t) strtol(argv[1], NULL, 0); // allow user to use decimal or hex
     }
-	uint8_t buf[32];
-	uint16_t address = 0;
-	while(count) {
-		uint16_t this_pass = count < 32?count:32; // number of bytes to read this pass
-		rc = at24c32_read(address, buf, this_pass);
-		hexdump(buf,this_pass);
-		// update for next pass
-		address+=this_pass;
-		count-=this_pass;
-	} // while-loop
-	return rc;
+    if(argc > 2) {
+    	address = (uint16_t) strtol(argv[2], NULL, 0);
+    }
+	return at24c32_stream_start(address, count, "atread");
 }
 
 const char qbf[]={"The quick brown fox jumped over the lazy dog."}; // 45 + null
@@ -127,59 +305,66 @@ const uint8_t randbytes[256]= {
 
 // command line method to write first 45 bytes in the device with "quick brown fox"
 int cl_write_at24c32(void) {
-	int rc = at24c32_write(0, (uint8_t *)qbf, strlen(qbf)); // don't write the terminating null
+	int rc = at24c32_write(0, (const uint8_t *)qbf, strlen(qbf)); // don't write the terminating null
 	return rc;
 }
 
 // command line method to dump the contents of the at24c32 device
 int cl_dump_at24c32(void) {
+	return at24c32_stream_start(0, AT24C32_BYTE_COUNT, "atdump");
+}
+
+// Fill runs as a task: queue one page write and sleep until it is sent, then poll for completion
+// of the write cycle between turns of the main loop - Ctrl-C to cancel
+static struct {
+	TASK task;
+	uint16_t addr;
 	int rc;
-	uint8_t buf[32];
-	for(uint16_t addr=0;addr<AT24C32_BYTE_COUNT;addr+=32) {
-		rc = at24c32_read(addr, buf, sizeof(buf));
-		hexdump(buf,sizeof(buf)); // this won't be the prettiest, since the address will be the same for each call
-		if(rc) return rc;
+	AT24C32_PAGE page;
+	uint8_t data[AT24C32_PAGE_WRITE_SIZE]; // page being written, in place until the write completes
+} at24c32_fill;
+
+static int at24c32_fill_task(TASK * t)
+{
+	TASK_BEGIN(t);
+	for(at24c32_fill.addr=0;at24c32_fill.addr<AT24C32_BYTE_COUNT;at24c32_fill.addr+=AT24C32_PAGE_WRITE_SIZE) {
+		// Each 256 bytes holds incrementing data, 0x00 through 0xFF
+		uint8_t data = (uint8_t)at24c32_fill.addr;
+		for(uint16_t i = 0;i<AT24C32_PAGE_WRITE_SIZE;i++) at24c32_fill.data[i] = data++;
+
+		if(at24c32_page_xfer(&at24c32_fill.page, at24c32_fill.addr, at24c32_fill.data, AT24C32_PAGE_WRITE_SIZE) ||
+				i2c_submit(&at24c32_fill.page.xfer)) TASK_EXIT(t);
+		if((uint8_t)data == 0) printf("."); // visual indicator for writing progress, each 256 bytes
+		TASK_WAIT_EVENT(t, at24c32_fill.page.xfer.status <= I2C_XFER_DONE);
+		if(at24c32_fill.page.xfer.status) {
+			printf("Error writing at24c32\n");
+			TASK_EXIT(t);
+		}
+		// Poll the device until it completes the page write
+		TASK_WAIT_UNTIL(t, AT24C32_BUSY != (at24c32_fill.rc = at24c32_write_poll()));
+		if(at24c32_fill.rc) TASK_EXIT(t);
 	} // for-loop
-	return rc;
+	printf("\n");
+	at24c32_twr_display();
+	TASK_ON_CANCEL(t);
+	// Ctrl-C: take back a page write still queued or on the bus (the device finishes a write cycle
+	// already started on its own)
+	i2c_cancel(&at24c32_fill.page.xfer);
+	TASK_END(t);
 }
 
 // command line method to fill the device with values 0x00 through 0xFF
 int cl_fill_at24c32(void) {
-	int rc;
-#if 0
-	// This section of code does a good job of filling the device, 32 bytes at a time
-	uint8_t buf[AT24C32_PAGE_WRITE_SIZE];
-	for(uint16_t addr=0;addr<AT24C32_BYTE_COUNT;addr+=32) {
-		// Fill buf for each page write
-		uint8_t data = (uint8_t)addr;
-		for(uint16_t i = 0;i<AT24C32_PAGE_WRITE_SIZE;i++) buf[i] = data++;
-
-		rc = at24c32_write(addr, buf, AT24C32_PAGE_WRITE_SIZE); // page write
-		if(rc) return rc;
-		printf(".");
-		HAL_Delay(10); // some delay is required to complete the page write
-	} // for-loop
-#else
-	// Fill the device, 256 bytes at a time
-	uint8_t buf[256];
-	// Write the 256 byte buffer with incrementing data
-	for(uint16_t i = 0;i<256;i++)
-		buf[i] = i;
-	// Write 256 bytes at a time until full (16 writes)
-	for(uint16_t addr=0;addr<AT24C32_BYTE_COUNT;addr+=256) {
-		rc = at24c32_write(addr, buf, sizeof(buf));
-		if(rc) return rc;
-		printf("."); // visual indicator for writing progress
-	} // for-loop
-#endif
-	printf("\n");
-	return rc;
+	at24c32_twr_reset();
+	return task_start(&at24c32_fill.task, at24c32_fill_task, "atfill");
 }
 
 // command line method to write 256 bytes to some address and then read it back and compare
 int cl_write_at24c32_256(void) {
-	int rc = at24c32_write(0x457, (uint8_t *)randbytes, sizeof(randbytes));
+	at24c32_twr_reset();
+	int rc = at24c32_write(0x457, randbytes, sizeof(randbytes));
 	if(rc) return rc;
+	at24c32_twr_display();
 	uint8_t readbuf[256];
 	rc = at24c32_read(0x457, readbuf, sizeof(readbuf));
 	if(rc) return rc;
@@ -187,7 +372,40 @@ int cl_write_at24c32_256(void) {
 		printf("Compare fail!\n");
 	else {
 		printf("Compare success!\n");
-		hexdump(readbuf,sizeof(readbuf));
+		hexdump_addr(readbuf,sizeof(readbuf),0x457);
 	}
 	return rc;
 }
+
+void at24c32_twr_reset(void)
+{
+	at24c32_twr.count = 0;
+	at24c32_twr.min = UINT32_MAX;
+	at24c32_twr.max = 0;
+	at24c32_twr.total = 0;
+	at24c32_twr.polls = 0;
+	at24c32_twr.bus_busy = 0;
+	at24c32_twr.timeouts = 0;
+}
+
+void at24c32_twr_display(void)
+{
+	if(!at24c32_twr.count) {
+		printf("No write cycles measured, %lu timeouts\n",at24c32_twr.timeouts);
+		return;
+	}
+	printf("Write cycle (tWR): %lu pages, min %luus, avg %luus, max %luus, %lu polls (%lu bus busy), %lu timeouts\n",
+			at24c32_twr.count,at24c32_twr.min,at24c32_twr.total/at24c32_twr.count,at24c32_twr.max,
+			at24c32_twr.polls,at24c32_twr.bus_busy,at24c32_twr.timeouts);
+}
+
+// command line method to display measured write cycle times
+// Expect: "attwr" or "attwr reset"
+int cl_at24c32_twr(void) {
+	at24c32_twr_display();
+	if(argc > 1 && argv[1][0] == 'r') {
+		at24c32_twr_reset();
+		printf("Statistics reset\n");
+	}
+	return 0;
+}
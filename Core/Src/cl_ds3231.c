@@ -7,6 +7,8 @@
 #include "command_line.h"
 #include "cl_i2c.h"
 #include "cl_ds3231.h"
+#include "i2c_registry.h"
+#include "i2c_async.h"
 #include "rtc_lib.h"
 
 // Forward declarations:
@@ -48,7 +50,7 @@ int ds_time_valid(void)
 	// If set, the oscillator was stopped in the past.  Time / date registers may be invalid.
 	uint8_t reg=DS_REG_STATUS;
 	uint8_t reg_value;
-	int rc = cl_i2c_write_read(I2C_ADDRESS_DS3231, &reg, 1, &reg_value, 1); // read status register, 0x0F
+	int rc = ds3231_read_registers(reg, &reg_value, 1); // read status register, 0x0F
 	if(rc) {
 		printf("Error reading DS3231 status register\n");
 		return rc;
@@ -60,13 +62,33 @@ int ds_time_valid(void)
 	return 0;
 }
 
+// DS3231 helper function - read count registers starting at reg
+// Always I2C1, as the writes and the presence check - "i2cbus" selects the bus for the i2c commands only
+// Return 0 for success
+int ds3231_read_registers(uint8_t reg, uint8_t * data, uint16_t count)
+{
+	return i2c_write_read(&i2c_bus1, I2C_ADDRESS_DS3231, &reg, 1, data, count);
+}
+
+// DS3231 helper function - write count registers starting at reg
+// The register index and the values go out as two segments of one write, no staging buffer
+// Return 0 for success
+int ds3231_write_registers(uint8_t reg, const uint8_t * data, uint16_t count)
+{
+	I2C_SEGMENT seg[2] = {{&reg, 1}, {data, count}};
+	return i2c_write_segments(&i2c_bus1, I2C_ADDRESS_DS3231, seg, 2);
+}
+
 // Check if DS3231 is present
+// Answered from the device registry while the DS3231 keeps responding, probing only when the
+// registry is stale or the previous transaction failed (see i2c_registry.c)
 // Returns 0 (HAL_OK) if present, else returns non-zero and displays error messages
 int ds3231_present(I2C_HandleTypeDef *hi2c)
 {
-	HAL_StatusTypeDef rc = HAL_I2C_IsDeviceReady(hi2c, (uint16_t)(I2C_ADDRESS_DS3231<<1), 2, 2);
-	if(HAL_OK != rc) printf("DS3231 not found!\n");
-	return rc;
+	(void)hi2c; // registry probes I2C1
+	if(i2c_device_present(I2C_ADDRESS_DS3231)) return HAL_OK;
+	printf("DS3231 not found!\n");
+	return HAL_ERROR;
 }
 
 //
@@ -76,26 +98,25 @@ int cl_ds_time(void)
 	int rc = ds3231_present(&hi2c1);
 	if(HAL_OK != rc) return rc;
 
-	uint8_t sec_min_hr[4];
+	uint8_t sec_min_hr[3];
 
 	switch(argc) {
 	case 4:
 		// Three arguments - Write time to time registers, clear status register - OSF bit
 		// Load buffer for I2C write - BCD format
-		sec_min_hr[3] = bin_to_bcd((uint8_t)strtol(argv[1],NULL,0)); // hours - allow user to use decimal or hex for address
-		sec_min_hr[2] = bin_to_bcd((uint8_t)strtol(argv[2],NULL,0)); // minutes
-		sec_min_hr[1] = bin_to_bcd((uint8_t)strtol(argv[3],NULL,0)); // seconds
-		sec_min_hr[0] = DS_REG_SECONDS; // begin writing to seconds register
+		sec_min_hr[2] = bin_to_bcd((uint8_t)strtol(argv[1],NULL,0)); // hours - allow user to use decimal or hex for address
+		sec_min_hr[1] = bin_to_bcd((uint8_t)strtol(argv[2],NULL,0)); // minutes
+		sec_min_hr[0] = bin_to_bcd((uint8_t)strtol(argv[3],NULL,0)); // seconds
 
-		rc = cl_i2c_write_read(I2C_ADDRESS_DS3231, sec_min_hr, 4, NULL, 0); // write time registers
+		rc = ds3231_write_registers(DS_REG_SECONDS, sec_min_hr, 3); // write time registers
 		if(rc) {
 			printf("Error writing DS3231 time registers\n");
 			return rc;
 		}
 
 		// Clear OSF status register bit
-		uint8_t index_status[2] = {DS_REG_STATUS,0};
-		rc = cl_i2c_write_read(I2C_ADDRESS_DS3231, index_status, 2, NULL, 0); // write status register
+		static const uint8_t status_clear = 0;
+		rc = ds3231_write_registers(DS_REG_STATUS, &status_clear, 1); // write status register
 		if(rc) {
 			printf("Error writing DS3231 status registers\n");
 			return rc;
@@ -111,7 +132,7 @@ int cl_ds_time(void)
 #if 0
 		// Read seconds, minutes, hours into buffer
 		uint8_t reg=DS_REG_SECONDS;
-		rc = cl_i2c_write_read(I2C_ADDRESS_DS3231, &reg, 1, sec_min_hr, 3); // read [0]seconds, [1]minutes, [2]hours
+		rc = ds3231_read_registers(reg, sec_min_hr, 3); // read [0]seconds, [1]minutes, [2]hours
 		if(rc) {
 			printf("Error reading DS3231 seconds, minutes, hours registers\n");
 			return rc;
@@ -148,18 +169,17 @@ int cl_ds_date(void)
 	if(HAL_OK != rc) return rc;
 
 	uint8_t reg=DS_REG_DATE;
-	uint8_t date_month_year[4];
+	uint8_t date_month_year[3];
 
 	switch(argc) {
 	case 4:
 		// Three arguments - Write date to calendar registers
 		// Load buffer for I2C write - BCD format
-		date_month_year[2] = bin_to_bcd((uint8_t)strtol(argv[1],NULL,0)); // month - allow user to use decimal or hex for address
-		date_month_year[1] = bin_to_bcd((uint8_t)strtol(argv[2],NULL,0)); // date
-		date_month_year[3] = bin_to_bcd((uint8_t)strtol(argv[3],NULL,0)); // year
-		date_month_year[0] = DS_REG_DATE; // begin writing to calendar date register
+		date_month_year[1] = bin_to_bcd((uint8_t)strtol(argv[1],NULL,0)); // month - allow user to use decimal or hex for address
+		date_month_year[0] = bin_to_bcd((uint8_t)strtol(argv[2],NULL,0)); // date
+		date_month_year[2] = bin_to_bcd((uint8_t)strtol(argv[3],NULL,0)); // year
 
-		rc = cl_i2c_write_read(I2C_ADDRESS_DS3231, date_month_year, 4, NULL, 0); // write calendar registers
+		rc = ds3231_write_registers(DS_REG_DATE, date_month_year, 3); // write calendar registers
 		if(rc) {
 			printf("Error writing DS3231 calendar registers\n");
 			return rc;
@@ -178,7 +198,7 @@ int cl_ds_date(void)
 		// No arguments - Display date - month/day/year
 		// Read date, month, year into buffer
 		// TODO: subtract off 6 hrs for local time (date)
-		rc = cl_i2c_write_read(I2C_ADDRESS_DS3231, &reg, 1, date_month_year, 3); // read [0]seconds, [1]minutes, [2]hours
+		rc = ds3231_read_registers(reg, date_month_year, 3); // read [0]seconds, [1]minutes, [2]hours
 		if(rc) {
 			printf("Error reading DS3231 date, month, year registers\n");
 			return rc;
@@ -203,7 +223,7 @@ int read_rtc_into_date_time(DATE_TIME * dt)
 	uint8_t rtc_buff[7];
 
 	// Read time and calendar registers into buffer
-	rc = cl_i2c_write_read(I2C_ADDRESS_DS3231, &reg, 1, rtc_buff, sizeof(rtc_buff));
+	rc = ds3231_read_registers(reg, rtc_buff, sizeof(rtc_buff));
 	if(rc) {
 		printf("Error reading DS3231 time calendar registers\n");
 		return rc;
@@ -229,19 +249,18 @@ int write_rtc_from_date_time(DATE_TIME * dt)
 	int rc;
 	printf("Writing Yr %u, Mo %u, Day %u, Hr %u, Min %u, Sec %u\n",dt->yOff,dt->month,dt->day,dt->hours,dt->minutes,dt->seconds);
 
-	uint8_t rtc_buff[8];
+	uint8_t rtc_buff[7];
 	// Using DATE_TIME structure, convert into bcd values to write to DS3231
-	rtc_buff[0] = DS_REG_SECONDS;
-	rtc_buff[1] = bin_to_bcd(dt->seconds);
-	rtc_buff[2] = bin_to_bcd(dt->minutes);
-	rtc_buff[3] = bin_to_bcd(dt->hours);
-	rtc_buff[4] = 1; // Force day of the week value to be valid - not implementing day of the week support
-	rtc_buff[5] = bin_to_bcd(dt->day);
-	rtc_buff[6] = bin_to_bcd(dt->month);
-	rtc_buff[7] = bin_to_bcd(dt->yOff);
+	rtc_buff[0] = bin_to_bcd(dt->seconds);
+	rtc_buff[1] = bin_to_bcd(dt->minutes);
+	rtc_buff[2] = bin_to_bcd(dt->hours);
+	rtc_buff[3] = 1; // Force day of the week value to be valid - not implementing day of the week support
+	rtc_buff[4] = bin_to_bcd(dt->day);
+	rtc_buff[5] = bin_to_bcd(dt->month);
+	rtc_buff[6] = bin_to_bcd(dt->yOff);
 
 	// Write time and calendar registers from buffer
-	rc = cl_i2c_write_read(I2C_ADDRESS_DS3231, rtc_buff, 8, NULL, 0);
+	rc = ds3231_write_registers(DS_REG_SECONDS, rtc_buff, sizeof(rtc_buff));
 	if(rc) {
 		printf("Error writing DS3231 time calendar registers\n");
 	}
@@ -9,15 +9,25 @@
 #include <stdlib.h> // strtol()
 #include "main.h"   // HAL functions and defines - HAL_I2C_MODULE_ENABLED in stm32f1xx_hal_conf.h
 #include "cl_i2c.h"
+#include "timestamp.h"
+#include "i2c_async.h"
+#include "i2c_ll.h"
+#include "i2c_registry.h"
+#include "i2c_pec.h"
 
 /* To implement the expected functionality, the following lines would be added to
    command_line.c, in the cmd_table[]:
 
 #ifdef HAL_I2C_MODULE_ENABLED
-	{"i2cscan",   "scan i2c bus for connected devices",           1, cl_i2c_scan},
-	{"i2cdump",   "i2cdump <i2c address>",                        2, cl_i2c_dump},
+	{"i2cscan",   "i2cscan <first> <last> <--quick>",             1, cl_i2c_scan},
+	{"i2cdump",   "i2cdump <i2c address> <first> <count> <-w> <-b>", 2, cl_i2c_dump},
 	{"i2cget",    "i2cget <i2c address> <register>",              3, cl_i2c_get},
 	{"i2cset",    "i2cset <i2c address> <register> <value>",      3, cl_i2c_set},
+	{"i2crs",     "i2crs <i2c address> <register> - restart timing", 3, cl_i2c_restart_bench},
+	{"i2cbus",    "i2cbus <1|2> or i2cbus bench <addr1> <addr2>", 1, cl_i2c_bus},
+	{"i2cread",   "i2cread <i2c address> <register> <count> <-w>", 3, cl_i2c_read},
+	{"i2cwrite",  "i2cwrite <i2c address> <register> <bytes..> <-w>", 4, cl_i2c_write},
+	{"i2cspeed",  "i2cspeed <i2c address> <kHz|bench> <16:9>",    1, cl_i2c_speed},
 #endif // HAL_I2C_MODULE_ENABLED
 
 */
@@ -25,6 +35,14 @@
 // HAL_I2C_MODULE_ENABLED will be set when an I2C interface is enabled within the ioc file
 #ifdef HAL_I2C_MODULE_ENABLED
 
+// Bus used by the i2cscan, i2cdump, i2cget, i2cset, i2cread, i2cwrite commands, see "i2cbus"
+I2C_BUS * cl_i2c_bus_selected = &i2c_bus1;
+
+// Register data collected by i2cdump and i2cread, displayed once the transaction is complete
+static uint8_t cl_i2c_buff[I2C_DUMP_MAX];
+
+void hexdump_addr(const void* address, unsigned count, unsigned displayaddr); // hexdump.c
+
 // I2C helper function that validates I2C address is within range
 // If I2C address is within range, return 0, else display error and return -1.
 int cl_i2c_validate_address(uint16_t i2c_address)
@@ -39,6 +57,13 @@ int cl_i2c_validate_address(uint16_t i2c_address)
 // I2C helper function that begins by writing zero or more bytes, followed by reading zero or more bytes.
 //  Assuming an 8-bit index register accessed I2C device, begin by writing to the index register,
 //    followed by reading from register.
+// When both writing and reading, this is one combined transaction: START, write, repeated START, read,
+// STOP.  No STOP / bus free time separates the index write from the read, and on a multi-master bus
+// no other master can step in between.
+// The transaction runs on the selected bus through i2c_write_read() (i2c_async.c), or with "i2cpec on"
+// i2c_write_read_pec() - SMBus packet error checking, for devices that support it.  Those print
+// nothing - this is the command line form, reporting any failure.  Only the generic i2c commands come
+// through here; device drivers (cl_ds3231.c, at24c32.c) call the engine directly, never with PEC.
 // Return 0 for success
 int cl_i2c_write_read(uint16_t i2c_address, uint8_t * pwrite, uint16_t wr_count, uint8_t * pread, uint16_t rd_count)
 {
@@ -46,100 +71,249 @@ int cl_i2c_write_read(uint16_t i2c_address, uint8_t * pwrite, uint16_t wr_count,
 	int rc=cl_i2c_validate_address(i2c_address);
 	if(rc) return rc;
 
-	// If there are bytes to write, write them
-	if(pwrite && wr_count) {
-		rc = HAL_I2C_Master_Transmit(&hi2c1, i2c_address<<1, pwrite, wr_count, I2C_SMALL_TIMEOUT);
-		if(rc) {
-			printf("i2c transmit error %d\n",rc);
-			return rc;
-		}
+	I2C_BUS * bus = cl_i2c_bus_selected;
+	if(i2c_pec_commands && rd_count > I2C_PEC_DATA_MAX) {
+		printf("Expect count 1 to %u with PEC on\n",I2C_PEC_DATA_MAX);
+		return -1;
 	}
-
-	// If there are bytes to read, read them
-	if(pread && rd_count) {
-		rc = HAL_I2C_Master_Receive(&hi2c1, i2c_address<<1, pread, rd_count, I2C_SMALL_TIMEOUT);
-		if(rc) {
-			printf("i2c receive error %d\n",rc);
-			return rc;
-		}
+	if(i2c_pec_commands)
+		rc = i2c_write_read_pec(bus, i2c_address, pwrite, wr_count, pread, rd_count);
+	else
+		rc = i2c_write_read(bus, i2c_address, pwrite, wr_count, pread, rd_count);
+	if(rc == I2C_XFER_PEC) {
+		printf("i2c PEC mismatch\n");
+	}
+	else if(rc) {
+		printf("i2c write/read error %d (0x%02lX)\n",rc,bus->last_error);
 	}
+	return rc;
+}
 
-	return 0;
+// Bus scan results - bit n of present[] is set if address n acknowledged
+static struct {
+	uint32_t present[4];   // 128 addresses
+	uint32_t tick;         // HAL_GetTick() at the end of the most recent scan, 0 if never scanned
+	uint32_t duration_us;  // time taken by the most recent scan
+} i2c_scan_cache;
+
+#define I2C_PRESENT_BIT(addr)  (1UL << ((addr) & 31))
+
+// Return non-zero if the most recent scan found a device at i2c_address
+int cl_i2c_present(uint16_t i2c_address)
+{
+	return i2c_address < 128 && (i2c_scan_cache.present[i2c_address >> 5] & I2C_PRESENT_BIT(i2c_address));
 }
 
 // Perform an I2C bus scan similar to Linux's i2cdetect, or Arduino's i2c_scanner sketch
+// Each address is probed at register level (i2c_ll.c) - a missing device costs one NACK, about 100us
+// at 100KHz, rather than a HAL tick based timeout.
+// Expect: "i2cscan", "i2cscan <first> <last>", and/or "i2cscan --quick" to probe only the addresses
+//   found by the previous scan
 int cl_i2c_scan(void)
 {
-    printf("I2C Scan - scanning I2C addresses 0x%02X - 0x%02X\n",I2C_ADDRESS_MIN,I2C_ADDRESS_MAX);
+	uint16_t first = I2C_ADDRESS_MIN, last = I2C_ADDRESS_MAX;
+	int quick = 0, numbers = 0;
+	for(int i=1;i<argc;i++) {
+		if(argv[i][0] == '-') quick = 1;
+		else if(numbers++ == 0) first = last = strtol(argv[i],NULL,0);
+		else last = strtol(argv[i],NULL,0);
+	}
+	if(first < I2C_ADDRESS_MIN || last > I2C_ADDRESS_MAX || first > last) {
+		printf("Expect range 0x%02X to 0x%02X\n",I2C_ADDRESS_MIN,I2C_ADDRESS_MAX);
+		return -1;
+	}
+	I2C_BUS * bus = cl_i2c_bus_selected;
+	if(quick && !i2c_scan_cache.tick) quick = 0; // nothing cached, scan them all
+
+	// Probe first, display afterwards - printing doesn't add gaps between probes
+	uint32_t seen[4];
+	for(int i=0;i<4;i++) seen[i] = i2c_scan_cache.present[i];
+	int found = 0, errors = 0;
+	uint32_t start = timestamp_us();
+	for(uint16_t addr=first;addr<=last;addr++) {
+		uint32_t * word = &i2c_scan_cache.present[addr >> 5];
+		if(quick && !(seen[addr >> 5] & I2C_PRESENT_BIT(addr))) continue;
+		int rc = i2c_bus_probe(bus, addr); // bus held for each probe, not the whole scan
+		if(rc == I2C_LL_ACK) {
+			*word |= I2C_PRESENT_BIT(addr);
+			if(bus == &i2c_bus1) i2c_registry_update(addr, I2C_DEVICE_PRESENT);
+			found++;
+		}
+		else {
+			*word &= ~I2C_PRESENT_BIT(addr);
+			if(rc == I2C_LL_ERROR) errors++;
+		}
+	}
+	i2c_scan_cache.duration_us = timestamp_us() - start;
+	i2c_scan_cache.tick = HAL_GetTick();
+	if(!i2c_scan_cache.tick) i2c_scan_cache.tick = 1; // 0 means never scanned
+
+    printf("%s Scan - scanning I2C addresses 0x%02X - 0x%02X%s\n",bus->name,first,last,quick? ", previously found only":"");
     // Display Hex Header
     printf("    "); for(int i=0;i<=0x0F;i++) printf(" %0X ",i);
-    // Walk through address range 0x00 - 0x77, but only test 0x03 - 0x77
+    // Walk through address range 0x00 - 0x77, displaying the requested range
     for(int addr=0;addr<=I2C_ADDRESS_MAX;addr++) {
     	// If address defines the beginning of a row, start a new row and display row text
     	if(!(addr%16)) printf("\n%02X: ",addr);
-		// Check I2C addresses in the range 0x03-0x7F
-		if(addr < I2C_ADDRESS_MIN || addr > I2C_ADDRESS_MAX) {
+		if(addr < first || addr > last) {
 			printf("   "); // out of range
 			continue;
 		}
-		// Perform I2C device detection - returns HAL_OK if device found
-		if(HAL_OK == HAL_I2C_IsDeviceReady(&hi2c1, (uint16_t)(addr<<1), 1, 2))
+		if(cl_i2c_present(addr))
 			printf("%02X ",addr);
 		else
 			printf("-- ");
     } // for-loop
-    printf("\n");
+    printf("\n%d found in %luus%s",found,i2c_scan_cache.duration_us,errors? "":"\n");
+    if(errors) printf(", %d bus errors\n",errors);
     return 0;
 } // cl_i2c_scanner
 
 
 // Read and display register content from I2C device
-// Expect: "i2cdump <i2caddress>"
+// Expect: "i2cdump <i2caddress> <first register> <count> <-w> <-b>"
 // By default, assume byte-wise register addressing, and display the first 16 registers
+//   -w  16-bit register addressing (the AT24C32, for example), high byte first
+//   -b  byte mode - one transaction per register, for devices that don't auto-increment
+// Otherwise, the whole range is read with one auto-incrementing burst: register index write,
+// repeated START, then count bytes (see cl_i2c_write_read()).
 // The HAL_I2C_ APIs require an 8-bit addresses vs 7-bit address (shift left is required)
 int cl_i2c_dump(void)
 {
 	uint16_t i2c_address = strtol(argv[1],NULL,0); // allow user to use decimal or hex for address
+	uint16_t first = 0, count = 16;
+	int wide = 0, byte_mode = 0, numbers = 0;
+	for(int i=2;i<argc;i++) {
+		if(argv[i][0] == '-') {
+			if(argv[i][1] == 'w') wide = 1;
+			else if(argv[i][1] == 'b') byte_mode = 1;
+		}
+		else if(numbers++ == 0) first = strtol(argv[i],NULL,0);
+		else count = strtol(argv[i],NULL,0);
+	}
 
 	// Validate I2C address is within range
 	int rc = cl_i2c_validate_address(i2c_address);
 	if(rc) return rc;
+	if(!count || count > I2C_DUMP_MAX || (!wide && first + count > 256)) {
+		printf("Expect 1 to %u registers%s\n",I2C_DUMP_MAX,wide? "":", ending at or before 0xFF");
+		return -1;
+	}
 
-    // Display Hex Header
-	for(int i=0;i<=0x0F;i++) printf(" %02X",i);
-	printf("\n\n");
-	// Write register address and then read the value
-	uint8_t i2c_reg;
-#if 0
-	// While analyzing the I2C bus, this code is slow, inserting delays as data is printed to the serial monitor
-	uint8_t i2c_data;
-	for(i2c_reg=0;i2c_reg<=0x0F;i2c_reg++) {
-		rc = HAL_I2C_Master_Transmit(&hi2c1, i2c_address<<1, &i2c_reg, 1, I2C_SMALL_TIMEOUT);
-		if(HAL_OK != rc) {printf("Error %d writing to I2C address 0x%02X\n",rc,i2c_address); return -2;}
-		rc = HAL_I2C_Master_Receive(&hi2c1, i2c_address<<1, &i2c_data, 1, I2C_SMALL_TIMEOUT);
-		if(HAL_OK != rc) {printf("Error %d reading from I2C address 0x%02X\n",rc,i2c_address); return -2;}
-		printf(" %02X",i2c_data);
-	}
-#else
 	// This collects the data into a buffer, printing it later when finished with the I2C bus
-	// As such, the I2C bus shows 16 groups of 4 bytes per group, minimal delays.  100KHz: 6.454ms, 400KHz: 1.725ms (totals for all 64 bytes)
-	uint8_t buff[16];
-	for(i2c_reg=0;i2c_reg<=0x0F;i2c_reg++) {
-		rc = HAL_I2C_Master_Transmit(&hi2c1, i2c_address<<1, &i2c_reg, 1, I2C_SMALL_TIMEOUT);
-		if(HAL_OK != rc) {printf("Error %d writing to I2C address 0x%02X\n",rc,i2c_address); return -2;}
-		rc = HAL_I2C_Master_Receive(&hi2c1, i2c_address<<1, &buff[i2c_reg], 1, I2C_SMALL_TIMEOUT);
-		if(HAL_OK != rc) {printf("Error %d reading from I2C address 0x%02X\n",rc,i2c_address); return -2;}
-		//printf(" %02X",i2c_data);
+	uint8_t * buff = cl_i2c_buff;
+	uint8_t index[2];
+	uint32_t start = timestamp_us();
+	if(byte_mode) {
+		for(uint16_t i=0;i<count && !rc;i++) {
+			uint16_t i2c_reg = first + i;
+			index[0] = wide? (uint8_t)(i2c_reg >> 8) : (uint8_t)i2c_reg;
+			index[1] = (uint8_t)i2c_reg;
+			rc = cl_i2c_write_read(i2c_address, index, wide? 2:1, &buff[i], 1);
+		}
 	}
-	for(i2c_reg=0;i2c_reg<=0x0F;i2c_reg++)
-		printf(" %02X",buff[i2c_reg]);
+	else {
+		index[0] = wide? (uint8_t)(first >> 8) : (uint8_t)first;
+		index[1] = (uint8_t)first;
+		rc = cl_i2c_write_read(i2c_address, index, wide? 2:1, buff, count);
+	}
+	uint32_t elapsed = timestamp_us() - start;
+	if(HAL_OK != rc) return -2; // cl_i2c_write_read() reported the failure
 
-#endif
-	printf("\n");
+	// Display i2cdump style grid: hex, then ASCII, 16 registers per row
+	printf(wide? "      ":"    ");
+	for(int i=0;i<=0x0F;i++) printf(" %02X",i);
+	printf("    0123456789ABCDEF\n");
+	uint16_t rows = ((first & 0x0F) + count + 15) / 16;
+	for(uint16_t r=0;r<rows;r++) {
+		uint16_t row = (first & ~0x0F) + r*16;
+		printf(wide? "%04X: ":"%02X: ",row);
+		for(int col=0;col<16;col++) {
+			uint16_t i = (uint16_t)(row + col - first);
+			if(i < count) printf(" %02X",buff[i]);
+			else printf("   ");
+		}
+		printf("    ");
+		for(int col=0;col<16;col++) {
+			uint16_t i = (uint16_t)(row + col - first);
+			if(i < count) printf("%c",buff[i] >= ' ' && buff[i] <= '~'? (char)buff[i] : '.');
+			else printf(" ");
+		}
+		printf("\n");
+	} // for-loop
+	printf("%u registers, %s: %luus\n",count,byte_mode? "one transaction per register":"one burst",elapsed);
 
 	return 0;
 }
 
+// Read a block of registers as one transaction, and hexdump it
+// Expect: "i2cread <i2caddress> <first register> <count> <-w>"
+//   -w  16-bit register addressing (EEPROM style devices, the AT24C32 for example), high byte first
+// Register index write, repeated START, then count bytes - the device auto-increments its index.
+int cl_i2c_read(void)
+{
+	uint16_t i2c_address = strtol(argv[1],NULL,0); // allow user to use decimal or hex for address
+	uint16_t reg = 0, count = 16;
+	int wide = 0, numbers = 0;
+	for(int i=2;i<argc;i++) {
+		if(argv[i][0] == '-') wide = argv[i][1] == 'w';
+		else if(numbers++ == 0) reg = strtol(argv[i],NULL,0);
+		else count = strtol(argv[i],NULL,0);
+	}
+	int rc = cl_i2c_validate_address(i2c_address);
+	if(rc) return rc;
+	if(!count || count > I2C_DUMP_MAX || (!wide && reg > 0xFF)) {
+		printf("Expect 1 to %u bytes%s\n",I2C_DUMP_MAX,wide? "":", register 0x00 to 0xFF");
+		return -1;
+	}
+
+	uint8_t index[2] = {wide? (uint8_t)(reg >> 8) : (uint8_t)reg, (uint8_t)reg};
+	uint32_t start = timestamp_us();
+	rc = cl_i2c_write_read(i2c_address, index, wide? 2:1, cl_i2c_buff, count);
+	uint32_t elapsed = timestamp_us() - start;
+	if(rc) return rc;
+	hexdump_addr(cl_i2c_buff, count, reg);
+	printf("%u bytes from 0x%02X, one transaction: %luus\n",count,i2c_address,elapsed);
+	return 0;
+}
+
+// Write a block of registers as one transaction
+// Expect: "i2cwrite <i2caddress> <first register> <byte> <byte>... <-w>"
+//   -w  16-bit register addressing, high byte first
+// The register index and the data go out as two segments of one write (see i2c_write_segments()).
+// EEPROM style devices limit one write to a page, and the bytes must not cross a page boundary.
+int cl_i2c_write(void)
+{
+	uint16_t i2c_address = strtol(argv[1],NULL,0); // allow user to use decimal or hex for address
+	uint16_t reg = 0, count = 0;
+	int wide = 0, have_reg = 0;
+	uint8_t data[MAXWORDS];
+	for(int i=2;i<argc;i++) {
+		if(argv[i][0] == '-') wide = argv[i][1] == 'w';
+		else if(!have_reg++) reg = strtol(argv[i],NULL,0);
+		else data[count++] = (uint8_t)strtol(argv[i],NULL,0);
+	}
+	int rc = cl_i2c_validate_address(i2c_address);
+	if(rc) return rc;
+	if(!count || (!wide && reg > 0xFF)) {
+		printf("Expect a register%s and at least one byte\n",wide? "":" 0x00 to 0xFF");
+		return -1;
+	}
+
+	uint8_t index[2] = {wide? (uint8_t)(reg >> 8) : (uint8_t)reg, (uint8_t)reg};
+	I2C_SEGMENT seg[2] = {{index, wide? 2:1}, {data, count}};
+	I2C_BUS * bus = cl_i2c_bus_selected;
+	uint32_t start = timestamp_us();
+	rc = i2c_write_segments(bus, i2c_address, seg, 2);
+	uint32_t elapsed = timestamp_us() - start;
+	if(rc) {
+		printf("Error %d writing to I2C address 0x%02X (0x%02lX)\n",rc,i2c_address,bus->last_error);
+		return rc;
+	}
+	printf("%u bytes to 0x%02X, one transaction: %luus\n",count,i2c_address,elapsed);
+	return 0;
+}
+
 // Read and display contents of a single byte-wise register
 // Expect: "i2cget <i2caddress> <i2cregister>"
 // The HAL_I2C_ APIs require an 8-bit addresses vs 7-bit address (shift left is required)
@@ -166,7 +340,6 @@ int cl_i2c_get(void)
 // The HAL_I2C_ APIs require an 8-bit addresses vs 7-bit address (shift left is required)
 int cl_i2c_set(void)
 {
-	HAL_StatusTypeDef hal_status;
 	uint8_t buffer[2];
 
 	uint16_t i2c_address = strtol(argv[1],NULL,0); // allow user to use decimal or hex for address
@@ -179,9 +352,190 @@ int cl_i2c_set(void)
 	if(rc) return rc;
 
 	// Write register address and value
-	hal_status = HAL_I2C_Master_Transmit(&hi2c1, i2c_address<<1, buffer, sizeof(buffer), I2C_SMALL_TIMEOUT);
-	if(HAL_OK != hal_status) {printf("Error %d writing to I2C address 0x%02X\n",hal_status,i2c_address); return -2;}
+	rc = cl_i2c_write_read(i2c_address, buffer, sizeof(buffer), NULL, 0); // reports any failure
+	if(rc) return -2;
 	return 0;
 }
 
+// Compare register reads done as two transactions (write, STOP, START, read) against one
+// repeated start transaction.  Timed with the DWT cycle counter, including HAL overhead.
+// Expect: "i2crs <i2caddress> <i2cregister>"
+int cl_i2c_restart_bench(void)
+{
+	uint16_t i2c_address = strtol(argv[1],NULL,0); // allow user to use decimal or hex for address
+	uint8_t i2c_register = strtol(argv[2],NULL,0); // allow user to use decimal or hex for register
+	int rc = cl_i2c_validate_address(i2c_address);
+	if(rc) return rc;
+
+	I2C_BUS * bus = cl_i2c_bus_selected;
+	if(i2c_bus_lock(bus, I2C_LOCK_TIMEOUT_MS)) { // polled HAL calls below
+		printf("%s busy\n",bus->name);
+		return -1;
+	}
+
+	const int loops = 16;
+	uint8_t separate, combined;
+	uint32_t start = timestamp_cycles();
+	for(int i=0;i<loops && !rc;i++) {
+		rc = HAL_I2C_Master_Transmit(bus->hi2c, i2c_address<<1, &i2c_register, 1, i2c_timeout_ms(bus, i2c_address, 1));
+		if(!rc) rc = HAL_I2C_Master_Receive(bus->hi2c, i2c_address<<1, &separate, 1, i2c_timeout_ms(bus, i2c_address, 1));
+	}
+	uint32_t separate_cycles = (timestamp_cycles() - start) / loops;
+	i2c_bus_unlock(bus);
+	if(rc) {printf("Error %d reading from I2C address 0x%02X\n",rc,i2c_address); return rc;}
+
+	start = timestamp_cycles();
+	for(int i=0;i<loops;i++) {
+		rc = cl_i2c_write_read(i2c_address, &i2c_register, 1, &combined, 1);
+		if(rc) return rc;
+	}
+	uint32_t combined_cycles = (timestamp_cycles() - start) / loops;
+
+	uint32_t mhz = SystemCoreClock / 1000000;
+	printf("Register read, two transactions:  %lu us (value %02X)\n",separate_cycles/mhz,separate);
+	printf("Register read, repeated start:    %lu us (value %02X)\n",combined_cycles/mhz,combined);
+	printf("Saved per register read:          %ld us\n",(int32_t)(separate_cycles - combined_cycles)/(int32_t)mhz);
+	return 0;
+}
+
+// Start a read on each bus, then wait for both
+static int cl_i2c_bus_pair(I2C_XFER * x1, I2C_XFER * x2)
+{
+	if(i2c_bus_submit(&i2c_bus1, x1)) return I2C_XFER_ERROR;
+	if(i2c_bus_submit(&i2c_bus2, x2)) {
+		i2c_wait(x1, i2c_timeout_ms(&i2c_bus1, x1->address, x1->rd_count));
+		return I2C_XFER_ERROR;
+	}
+	int rc1 = i2c_wait(x1, i2c_timeout_ms(&i2c_bus1, x1->address, x1->rd_count));
+	int rc2 = i2c_wait(x2, i2c_timeout_ms(&i2c_bus2, x2->address, x2->rd_count));
+	return rc1? rc1 : rc2;
+}
+
+// Display each bus, select the bus used by the i2c commands, or compare one bus at a time against
+// both buses in parallel
+// Expect: "i2cbus", "i2cbus <1|2>", or "i2cbus bench <address on I2C1> <address on I2C2>"
+int cl_i2c_bus(void)
+{
+	if(argc > 1 && argv[1][0] == 'b') {
+		if(argc < 4) {
+			printf("Expect: i2cbus bench <address on I2C1> <address on I2C2>\n");
+			return -1;
+		}
+		uint16_t addr1 = strtol(argv[2],NULL,0), addr2 = strtol(argv[3],NULL,0);
+		int rc = cl_i2c_validate_address(addr1);
+		if(!rc) rc = cl_i2c_validate_address(addr2);
+		if(rc) return rc;
+
+		// 32 byte reads from each device's current register / address
+		uint8_t buf1[32], buf2[32];
+		I2C_XFER x1, x2;
+		const int loops = 16;
+		uint32_t start = timestamp_us();
+		for(int i=0;i<loops && !rc;i++) {
+			rc = i2c_write_read(&i2c_bus1, addr1, NULL, 0, buf1, sizeof(buf1));
+			if(!rc) rc = i2c_write_read(&i2c_bus2, addr2, NULL, 0, buf2, sizeof(buf2));
+		}
+		uint32_t serial_us = timestamp_us() - start;
+		start = timestamp_us();
+		for(int i=0;i<loops && !rc;i++) {
+			i2c_xfer_init(&x1, addr1, NULL, 0, buf1, sizeof(buf1));
+			i2c_xfer_init(&x2, addr2, NULL, 0, buf2, sizeof(buf2));
+			rc = cl_i2c_bus_pair(&x1, &x2);
+		}
+		uint32_t parallel_us = timestamp_us() - start;
+		if(rc) {
+			printf("i2c read error %d\n",rc);
+			return rc;
+		}
+		printf("Two %u byte reads, one bus at a time: %4luus\n",(unsigned)sizeof(buf1),serial_us/loops);
+		printf("Two %u byte reads, both buses:        %4luus\n",(unsigned)sizeof(buf1),parallel_us/loops);
+		return 0;
+	}
+
+	if(argc > 1) {
+		int n = atoi(argv[1]);
+		if(n < 1 || n > I2C_BUS_COUNT) {
+			printf("Expect bus 1 to %u\n",I2C_BUS_COUNT);
+			return -1;
+		}
+		if(cl_i2c_bus_selected != i2c_buses[n-1]) i2c_scan_cache.tick = 0; // scan results belong to the other bus
+		cl_i2c_bus_selected = i2c_buses[n-1];
+	}
+	for(int i=0;i<I2C_BUS_COUNT;i++) {
+		I2C_BUS * bus = i2c_buses[i];
+		printf("%c%s: %lu Hz, %lu transactions, %lu failed",bus == cl_i2c_bus_selected? '*':' ',bus->name,
+				bus->hi2c->Init.ClockSpeed,bus->transactions,bus->failures);
+		if(bus->failures)
+			printf(", last: 0x%02X status %d error 0x%02lX",bus->last_address,bus->last_status,bus->last_error);
+		printf("%s\n",i2c_bus_busy(bus)? ", busy":"");
+		printf("  polled: %lu, contended: %lu, deferred: %lu (longest wait %luus)\n",bus->locks,
+				bus->contended,bus->deferred,bus->deferred_max_us);
+	}
+	return 0;
+}
+
+// Display the speed table, or set a device's speed, or measure read throughput at each speed
+// The device is the address on the selected bus (see "i2cbus")
+// Expect: "i2cspeed", "i2cspeed <i2caddress> <kHz> <16:9>" (kHz 0 removes the entry),
+//   or "i2cspeed <i2caddress> bench"
+int cl_i2c_speed(void)
+{
+	if(argc < 3) {
+		for(int i=0;i<I2C_BUS_COUNT;i++)
+			printf("%s SCL: %lu Hz%s, actual %lu Hz\n",i2c_buses[i]->name,i2c_buses[i]->hi2c->Init.ClockSpeed,
+					i2c_buses[i]->hi2c->Init.DutyCycle == I2C_DUTYCYCLE_16_9? " (16:9)":"",
+					i2c_scl_hz(i2c_buses[i]->hi2c->Init.ClockSpeed, i2c_buses[i]->hi2c->Init.DutyCycle));
+		printf("Default: %u Hz\n",I2C_SPEED_DEFAULT);
+		for(int i=0;i<I2C_SPEED_TABLE_SIZE;i++) {
+			I2C_SPEED_ENTRY * e = &i2c_speed_table[i];
+			if(e->address)
+				printf("%s 0x%02X: %lu Hz%s\n",e->bus->name,e->address,e->clock_speed,e->duty_cycle == I2C_DUTYCYCLE_16_9? " (16:9)":"");
+		}
+		return 0;
+	}
+
+	uint16_t i2c_address = strtol(argv[1],NULL,0); // allow user to use decimal or hex for address
+	int rc = cl_i2c_validate_address(i2c_address);
+	if(rc) return rc;
+	const I2C_BUS * bus = cl_i2c_bus_selected;
+
+	if(argv[2][0] != 'b') {
+		uint32_t khz = strtol(argv[2],NULL,0);
+		uint32_t duty = argc > 3 && argv[3][0] == '1'? I2C_DUTYCYCLE_16_9 : I2C_DUTYCYCLE_2;
+		if(i2c_speed_set(bus, i2c_address, khz * 1000, duty)) {
+			printf("Expect 10 to 400 kHz (or 0 to remove), table size %u\n",I2C_SPEED_TABLE_SIZE);
+			return -1;
+		}
+		return 0;
+	}
+
+	// Throughput - 32 byte reads (from the device's current register / address) at each speed
+	static const I2C_SPEED_ENTRY profiles[] = {
+		{NULL, 0, 100000, I2C_DUTYCYCLE_2},
+		{NULL, 0, 400000, I2C_DUTYCYCLE_2},
+		{NULL, 0, 400000, I2C_DUTYCYCLE_16_9},
+	};
+	I2C_SPEED_ENTRY saved = *i2c_speed_lookup(bus, i2c_address);
+	uint8_t buf[32];
+	const int loops = 16;
+	for(unsigned p=0;p<sizeof(profiles)/sizeof(profiles[0]);p++) {
+		if(i2c_speed_set(bus, i2c_address, profiles[p].clock_speed, profiles[p].duty_cycle)) {
+			printf("Speed table full, %u entries\n",I2C_SPEED_TABLE_SIZE);
+			rc = -1;
+			break;
+		}
+		uint32_t start = timestamp_us();
+		for(int i=0;i<loops && !rc;i++)
+			rc = cl_i2c_write_read(i2c_address, NULL, 0, buf, sizeof(buf));
+		uint32_t elapsed = timestamp_us() - start;
+		if(rc) break;
+		// Label each row with the rate CCR actually gives, not the one asked for
+		printf("%lu Hz%-7s %4luus per %u byte read, %lu bytes/s\n",i2c_scl_hz(profiles[p].clock_speed, profiles[p].duty_cycle),
+				profiles[p].duty_cycle == I2C_DUTYCYCLE_16_9? " (16:9)":"",elapsed/loops,(unsigned)sizeof(buf),
+				(uint32_t)((uint64_t)loops * sizeof(buf) * 1000000 / elapsed));
+	}
+	i2c_speed_set(bus, i2c_address, saved.address? saved.clock_speed : 0, saved.duty_cycle);
+	return rc;
+}
+
 #endif // HAL_I2C_MODULE_ENABLED
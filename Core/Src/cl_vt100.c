@@ -8,6 +8,7 @@
 #include "command_line.h"
 #include "cl_vt100.h"
 #include "main.h" // HAL APIs
+#include "task.h"
 
 /*
 Cursor Functions:
@@ -85,28 +86,48 @@ void box(int row1, int col1, int row2, int col2)
 // Provide initial snake position, followed by null terminated char array using characters:
 // U: up, D: down, L: left, R: right for location of next snake segment
 // Provide a delay (milliseconds) after drawing each segment
-void snake(int row, int col, const char * path, int seg_delay)
+// The snake is drawn by a task, sleeping between segments - Ctrl-C to cancel.
+static struct {
+	TASK task;
+	int row;
+	int col;
+	const char * path;
+	int seg_delay;
+} snake_state;
+
+static int snake_task(TASK * t)
 {
+	TASK_BEGIN(t);
 	// Cursor display off
 	printf(VT100_CURSOR_OFF);
 
 	// initial snake position
-	printf(VT100_CURSOR_Y_X "%d;%dH" VT100_LINE_DRAW "a",row,col);
-	for(;*path;) {
-		switch(*path++) {
-			case 'U': row--; break;
-			case 'D': row++; break;
-			case 'L': col--; if(col<1) col=1; break;
-			case 'R': col++; if(col>80) col=80; break;
-			default: printf(VT100_ASCII "%s error",__func__); return;
-		} // switch
+	printf(VT100_CURSOR_Y_X "%d;%dH" VT100_LINE_DRAW "a",snake_state.row,snake_state.col);
+	while(*snake_state.path) {
+		char direction = *snake_state.path++;
+		if(direction == 'U') snake_state.row--;
+		else if(direction == 'D') snake_state.row++;
+		else if(direction == 'L') { snake_state.col--; if(snake_state.col<1) snake_state.col=1; }
+		else if(direction == 'R') { snake_state.col++; if(snake_state.col>80) snake_state.col=80; }
+		else { printf(VT100_ASCII "%s error",__func__); break; }
 		// position cursor, write character
-		printf(VT100_CURSOR_Y_X "%d;%dH" VT100_LINE_DRAW "a",row,col);
-		HAL_Delay(seg_delay);
-	} // for-loop
+		printf(VT100_CURSOR_Y_X "%d;%dH" VT100_LINE_DRAW "a",snake_state.row,snake_state.col);
+		TASK_DELAY(t, snake_state.seg_delay);
+	} // while-loop
+
+	TASK_ON_CANCEL(t);
+	// Cursor display on, restore character set and cursor position (see cl_vt100())
+	printf(VT100_ASCII VT100_CURSOR_ON VT100_CURSOR_RESTORE);
+	TASK_END(t);
+}
 
-	// Cursor display on
-	printf(VT100_CURSOR_ON);
+int snake(int row, int col, const char * path, int seg_delay)
+{
+	snake_state.row = row;
+	snake_state.col = col;
+	snake_state.path = path;
+	snake_state.seg_delay = seg_delay;
+	return task_start(&snake_state.task, snake_task, "snake");
 }
 
 const char snakepath[]={"RRRRRLLDDDDDDDDLLLLLU"}; // draw Capital J
@@ -129,13 +150,8 @@ int cl_vt100(void)
 	printf("\nBelow box " VT100_LINE_DRAW "%c" VT100_ASCII "\n",0x61); // 0x61 Line Draw is a solid box
 
 	// Draw a short "snake", inside the box, growing slowly
-	// Remember current cursor position
+	// Remember current cursor position - the snake task restores it when done
 	printf(VT100_CURSOR_SAVE);
 
-	snake(14, 6, snakepath, 500);
-
-	// Restore cursor position
-	printf(VT100_CURSOR_RESTORE);
-
-	return 0;
+	return snake(14, 6, snakepath, 500);
 }
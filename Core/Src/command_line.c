@@ -19,9 +19,22 @@
 #include "command_line.h"
 #include "main.h"   // HAL functions and defines
 #include "cl_i2c.h"
+#include "i2c_async.h"
+#include "i2c_registry.h"
+#include "i2c_trace.h"
+#include "i2c_stats.h"
+#include "i2c_recover.h"
+#include "i2c_ll.h"
+#include "sampler.h"
+#include "i2c_target.h"
+#include "i2c_pec.h"
 #include "cl_ds3231.h"
 #include "at24c32.h"
 #include "cl_vt100.h"
+#include "serial.h"
+#include "timestamp.h"
+#include "events.h"
+#include "task.h"
 
 // Typedefs
 typedef struct {
@@ -40,32 +53,106 @@ const COMMAND_ITEM cmd_table[] = {
     {"reset",     "reset processor",                              1, cl_reset},
     {"timer",     "timer test - testing 50ms delay",              1, cl_timer},
 	{"delaytest", "test microsecond delays",                      1, cl_timer_delay_test},
+    {"uart",      "uart statistics <reset>",                      1, cl_serial_stats},
+    {"latency",   "command latency statistics <reset>",           1, cl_latency},
+    {"cmdbench",  "command lookup benchmark",                     1, cl_cmd_bench},
+    {"tasks",     "list active tasks",                            1, cl_tasks},
 #ifdef HAL_I2C_MODULE_ENABLED
-	{"i2cscan",   "scan i2c bus for connected devices",           1, cl_i2c_scan},
-	{"i2cdump",   "i2cdump <i2c address>",                        2, cl_i2c_dump},
+	{"i2cscan",   "i2cscan <first> <last> <--quick>",             1, cl_i2c_scan},
+	{"i2cdump",   "i2cdump <i2c address> <first> <count> <-w> <-b>", 2, cl_i2c_dump},
 	{"i2cget",    "i2cget <i2c address> <register>",              3, cl_i2c_get},
 	{"i2cset",    "i2cset <i2c address> <register> <value>",      3, cl_i2c_set},
+	{"i2cbus",    "i2cbus <1|2> or i2cbus bench <addr1> <addr2>", 1, cl_i2c_bus},
+	{"i2cread",   "i2cread <i2c address> <register> <count> <-w>", 3, cl_i2c_read},
+	{"i2cwrite",  "i2cwrite <i2c address> <register> <bytes..> <-w>", 4, cl_i2c_write},
+	{"i2crs",     "i2crs <i2c address> <register> - restart timing", 3, cl_i2c_restart_bench},
+	{"i2cbench",  "i2cbench <i2c address> <register> <count 1-3>", 3, cl_i2c_ll_bench},
+	{"i2cspeed",  "i2cspeed <i2c address> <kHz|bench> <16:9>",    1, cl_i2c_speed},
+	{"i2cdev",    "i2c device registry <reset>",                  1, cl_i2c_registry},
+	{"i2ctrace",  "i2ctrace <i2c address|clear|export>",          1, cl_i2c_trace},
+	{"i2cstats",  "i2c statistics per device <reset>",            1, cl_i2c_stats},
+	{"i2crecover","i2c bus recovery statistics <force> <bus>",    1, cl_i2c_recover},
+	{"i2cpec",    "i2cpec <on|off|hw|sw|reset|bench addr reg count>", 1, cl_i2c_pec},
+	{"i2ctarget", "i2ctarget <at24c32|ds3231 <bus>|off|dump first count|reset>", 1, cl_i2c_target},
+	{"sample",    "sample <start Hz|stop|drain|add addr reg count|clear|reset>", 1, cl_sample},
     {"time",      "time <hrs min sec>",                           1, cl_ds_time},
     {"date",      "date <mm dd yy>",                              1, cl_ds_date},
     {"ts",        "Unix time (in seconds)",                       1, cl_ds_time_stamp},
 
-	{"atread",    "Read <count - default 32> bytes from at24c32", 1, cl_read_at24c32},
+	{"atread",    "atread <count - default 32> <address>",        1, cl_read_at24c32},
 	{"atwrite",   "Write to first 32 bytes of at24c32",           1, cl_write_at24c32},
 	{"atdump",    "Dump the contents of the at24c32",             1, cl_dump_at24c32},
 	{"atfill",    "Fill the at24c32 with incrementing data",      1, cl_fill_at24c32},
 	{"at256",     "Write 256 random bytes, read and compare",     1, cl_write_at24c32_256},
+	{"attwr",     "at24c32 write cycle times <reset>",            1, cl_at24c32_twr},
 
 	{"vt100",     "Example VT100 cursor movement",                1, cl_vt100},
 #endif // HAL_I2C_MODULE_ENABLED
     {NULL,NULL,0,NULL}, /* end of table */
 };
 
+// Commands are grouped by module in cmd_table[], for the help display.  For dispatch, cl_setup()
+// sorts an index of the table by command name once, allowing a binary search for each command.
+// New rows may be added to cmd_table[] in any order.
+#define CMD_TABLE_COUNT (sizeof(cmd_table)/sizeof(cmd_table[0]) - 1) // less end of table marker
+static uint8_t cmd_sorted[CMD_TABLE_COUNT]; // cmd_table[] indexes, in command name order
+
 // Globals:
 char buffer[MAXSERIALBUF]; // holds command strings from user
 char * argv[MAXWORDS]; // pointers into buffer
 int argc; // number of words (command & arguments)
 
+// Command latency: time from the receive interrupt that delivered a command line,
+// until the command begins executing (micro-seconds)
+static struct {
+    uint32_t count;
+    uint32_t last;
+    uint32_t min;
+    uint32_t max;
+    uint32_t total;
+} cl_latency_stats = {0, 0, UINT32_MAX, 0, 0};
+
+// Build cmd_sorted[] - insertion sort, the table is small and this runs once
+static void cl_sort_commands(void)
+{
+    for (unsigned i = 0; i < CMD_TABLE_COUNT; i++) {
+        unsigned j = i;
+        while (j && strcmp(cmd_table[cmd_sorted[j - 1]].command, cmd_table[i].command) > 0) {
+            cmd_sorted[j] = cmd_sorted[j - 1];
+            j--;
+        }
+        cmd_sorted[j] = (uint8_t) i;
+    }
+}
+
+// Look up a command by name, binary search of cmd_sorted[]
+// Return the cmd_table[] index, or -1 if not found
+static int cl_find_command(const char * command)
+{
+    int low = 0;
+    int high = CMD_TABLE_COUNT - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        int cmp = strcmp(command, cmd_table[cmd_sorted[mid]].command);
+        if (cmp == 0) return cmd_sorted[mid];
+        if (cmp < 0)
+            high = mid - 1;
+        else
+            low = mid + 1;
+    }
+    return -1;
+}
+
+// Look up a command by name, walking the table (the original method - kept for cl_cmd_bench())
+static int cl_find_command_linear(const char * command)
+{
+    for (int i = 0; cmd_table[i].function; i++)
+        if (strcmp(command, cmd_table[i].command) == 0) return i;
+    return -1;
+}
+
 void cl_setup(void) {
+    cl_sort_commands();
     // The STM32 development environment's stdio library provides buffering of stdout stream by default.  Turn it off!
     setvbuf(stdout, NULL, _IONBF, 0);
     // Turn on yellow text, print greeting, reset attributes
@@ -75,8 +162,8 @@ void cl_setup(void) {
 }
 
 // Externals
-int __io_getchar(void);   // main.c
-int __io_putchar(int ch); // main.c
+int __io_getchar(void);   // serial.c
+int __io_putchar(int ch); // serial.c
 
 // Check for data available from USART interface.  If none present, just return.
 // If data available, process it (add it to character buffer if appropriate)
@@ -96,11 +183,19 @@ void cl_loop(void)
           case _LF:
             buffer[index] = 0; // null terminate
             if(index) {
+                uint32_t latency = timestamp_us() - serial_rx_timestamp;
+                cl_latency_stats.count++;
+                cl_latency_stats.last = latency;
+                cl_latency_stats.total += latency;
+                if(latency < cl_latency_stats.min) cl_latency_stats.min = latency;
+                if(latency > cl_latency_stats.max) cl_latency_stats.max = latency;
         		putchar(_LF); // newline
             	cl_process_buffer(); // process the null terminated buffer
             }
-    		printf("\n>");
             index = 0; // reset buffer index
+            // A command that started a task prompts when the task is done, see task.c
+            if(!task_foreground_busy())
+                printf("\n>");
             return;
           case _BS:
             if(index<1) continue;
@@ -118,6 +213,13 @@ void cl_loop(void)
   return;
 } // cl_loop()
 
+// Display the prompt after a command's task completes, then pick up any input typed meanwhile
+void cl_prompt(void)
+{
+    printf("\n>");
+    if(ring_count(&serial_rx_ring)) event_post(EVENT_UART_RX);
+}
+
 void cl_process_buffer(void)
 {
     argc = cl_parseArgcArgv(buffer, argv, MAXWORDS);
@@ -127,26 +229,19 @@ void cl_process_buffer(void)
     if (argc) {
         // At least one "word" / argument found
         // See if command has a match in the command table
-        // If null function pointer found, exit for-loop
-        int cmdIndex;
-        for (cmdIndex = 0; cmd_table[cmdIndex].function; cmdIndex++) {
-            if (strcmp(argv[0], cmd_table[cmdIndex].command) == 0) {
-                // We found a match in the table
-                // Enough arguments?
-                if (argc < cmd_table[cmdIndex].arg_cnt) {
-                    printf("\r\nInvalid Arg cnt: %d Expected: %d\n", argc - 1,
-                            cmd_table[cmdIndex].arg_cnt - 1);
-                    break;
-                }
-                // Call the function associated with the command
-                (*cmd_table[cmdIndex].function)();
-                break; // exit for-loop
-            }
-        } // for-loop
-          // If we compared all the command strings and didn't find the command, or we want to fake that event
-        if (!cmd_table[cmdIndex].command) {
+        int cmdIndex = cl_find_command(argv[0]);
+        if (cmdIndex < 0) {
             printf("Command \"%s\" not found\r\n", argv[0]);
         }
+        // Enough arguments?
+        else if (argc < cmd_table[cmdIndex].arg_cnt) {
+            printf("\r\nInvalid Arg cnt: %d Expected: %d\n", argc - 1,
+                    cmd_table[cmdIndex].arg_cnt - 1);
+        }
+        else {
+            // Call the function associated with the command
+            (*cmd_table[cmdIndex].function)();
+        }
     } // At least one "word" / argument found
 }
 
@@ -282,6 +377,7 @@ char * PrintHalStatus(int status)
 
 // Reset the processor
 int cl_reset(void) {
+    serial_flush(); // let any buffered output leave the UART
     NVIC_SystemReset(); // CMSIS Cortex-M3 function - see Drivers/CMSIS/Include/core_cm3.h
     while (1) ; // wait here until reset completes
 
@@ -309,6 +405,54 @@ int cl_timer(void)
     return 0;
 }
 
+// Display (and optionally reset) command latency statistics
+// Expect: "latency" or "latency reset"
+int cl_latency(void)
+{
+    printf("Main loop: %s\n",EVENT_LOOP_POLLED? "polled, 50ms":"event driven, WFI");
+    if(cl_latency_stats.count) {
+        printf("Commands: %lu\n",cl_latency_stats.count);
+        printf("Latency us: last %lu, min %lu, max %lu, avg %lu\n",cl_latency_stats.last,
+                cl_latency_stats.min,cl_latency_stats.max,cl_latency_stats.total/cl_latency_stats.count);
+    }
+    if(argc > 1 && argv[1][0] == 'r') {
+        cl_latency_stats.count = 0;
+        cl_latency_stats.total = 0;
+        cl_latency_stats.min = UINT32_MAX;
+        cl_latency_stats.max = 0;
+        printf("Statistics reset\n");
+    }
+    return 0;
+}
+
+// Compare the cost of looking up each command: table walk vs binary search
+// CPU cycles are counted with the DWT cycle counter (72 cycles per micro-second)
+#define CMD_BENCH_LOOPS 100
+int cl_cmd_bench(void)
+{
+    uint32_t linear_total = 0, binary_total = 0;
+    printf("Command     Linear  Binary (cycles per lookup)\n");
+    // Each command in the table, plus one that isn't found
+    for (unsigned i = 0; i <= CMD_TABLE_COUNT; i++) {
+        const char * command = i < CMD_TABLE_COUNT? cmd_table[i].command : "notfound";
+        volatile int found; // keep the compiler from removing the lookups
+        uint32_t start = timestamp_cycles();
+        for (int loop = 0; loop < CMD_BENCH_LOOPS; loop++)
+            found = cl_find_command_linear(command);
+        uint32_t linear = (timestamp_cycles() - start) / CMD_BENCH_LOOPS;
+        start = timestamp_cycles();
+        for (int loop = 0; loop < CMD_BENCH_LOOPS; loop++)
+            found = cl_find_command(command);
+        uint32_t binary = (timestamp_cycles() - start) / CMD_BENCH_LOOPS;
+        (void)found;
+        printf("%-12s%6lu  %6lu\n", command, linear, binary);
+        linear_total += linear;
+        binary_total += binary;
+    }
+    printf("Average     %6lu  %6lu\n", linear_total / (CMD_TABLE_COUNT + 1), binary_total / (CMD_TABLE_COUNT + 1));
+    return 0;
+}
+
 // Using a 16 bit timer spin-delay a quantity of micro-seconds
 // Timer is configured to increment each micro-second
 // This function appears to work perfectly at 64-72MHz system clock, always returning 1000us, when 1000us was requested
@@ -332,10 +476,10 @@ uint16_t timer_delay_us(uint32_t delay_us)
 //#define USEARRAY	1
 
 // Test timer_delay_us() function
+#ifdef USEARRAY
 int cl_timer_delay_test(void)
 {
     printf("%s()\n",__func__);
-#ifdef USEARRAY
     // Use array to collect and then display the results of 1024 tests
     uint16_t delay_results[1024];
     uint16_t i;
@@ -348,28 +492,42 @@ int cl_timer_delay_test(void)
 	for(i=0; i<1024; i++)
 		printf("%u:%u%s\n",i,delay_results[i],delay_results[i]<=1002?"":" <======="); // display marker for larger values
 
+    return 0;
+}
 #else
-    	// Analyze the delta time returned
-        uint16_t delta;
-        uint16_t i;
-
-        // For 60 seconds, test the timer_delay_us timer, looking for a delta that isn't 1000us
-        // 60 seconds count down
-        for(int seconds=59; seconds >= 0; seconds--) {
-        	// 1024 1 ms delays (1 second or so)
-        	for(i=0; i<1024; i++) {
-    			delta = timer_delay_us(1000); // 1ms delay
-    			if(delta > 1000) {
-    				printf("Not 1000us: %u\n",delta);
-    				return 1;
-    			}
-        	}
-        	printf("\b\b  \b\b%d",seconds); // seconds count down - erase previous display each time
-        }
-        printf("\b \n"); // erase the remaining '0', then line feed
-        printf("60 seconds worth of 1000us delays - each delay returned 1000us!\n");
-#endif
+// Delay test runs as a task, yielding after each 1ms delay - Ctrl-C to cancel
+static struct {
+    TASK task;
+    int seconds;
+    uint16_t i;
+} delay_test;
 
-    return 0;
+static int delay_test_task(TASK * t)
+{
+    TASK_BEGIN(t);
+    // For 60 seconds, test the timer_delay_us timer, looking for a delta that isn't 1000us
+    // 60 seconds count down
+    for(delay_test.seconds=59; delay_test.seconds >= 0; delay_test.seconds--) {
+    	// 1024 1 ms delays (1 second or so)
+    	for(delay_test.i=0; delay_test.i<1024; delay_test.i++) {
+    		uint16_t delta = timer_delay_us(1000); // 1ms delay
+    		if(delta > 1000) {
+    			printf("Not 1000us: %u\n",delta);
+    			TASK_EXIT(t);
+    		}
+    		TASK_YIELD(t);
+    	}
+    	printf("\b\b  \b\b%d",delay_test.seconds); // seconds count down - erase previous display each time
+    }
+    printf("\b \n"); // erase the remaining '0', then line feed
+    printf("60 seconds worth of 1000us delays - each delay returned 1000us!\n");
+    TASK_END(t);
 }
 
+int cl_timer_delay_test(void)
+{
+    printf("%s()\n",__func__);
+    return task_start(&delay_test.task, delay_test_task, "delaytest");
+}
+#endif
+
@@ -0,0 +1,64 @@
+// File: events.c
+//
+// Event flags for the main loop.
+//
+// Any context may post events.  The main loop collects and clears all pending events at once with
+// event_wait(), which sleeps the core (WFI) while nothing is pending.  Interrupts are masked (PRIMASK)
+// between testing for events and executing WFI: an interrupt arriving in that window still wakes the
+// core, and its handler runs as soon as PRIMASK is cleared, so no event can be missed.
+
+#include "main.h"   // HAL functions and defines, CMSIS intrinsics
+#include "events.h"
+
+static volatile uint32_t event_pending;
+static volatile uint32_t event_timer_ms; // one-shot timer count down, 0 == stopped
+
+// Post one or more events - safe from any context
+void event_post(uint32_t events)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	event_pending |= events;
+	__set_PRIMASK(primask);
+}
+
+// Return and clear pending events without waiting (may return 0)
+uint32_t event_get(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint32_t events = event_pending;
+	event_pending = 0;
+	__set_PRIMASK(primask);
+	return events;
+}
+
+// Sleep until at least one event is pending, then return and clear the pending events
+// Main loop (thread) context only
+uint32_t event_wait(void)
+{
+	while(1) {
+		__disable_irq();
+		uint32_t events = event_pending;
+		if(events) {
+			event_pending = 0;
+			__enable_irq();
+			return events;
+		}
+		__WFI(); // wakes on any interrupt, even while masked
+		__enable_irq(); // let the interrupt handler run
+	}
+}
+
+// Post EVENT_TIMER after ms milliseconds.  Restarts a running timer, 0 cancels.
+void event_timer_start(uint32_t ms)
+{
+	event_timer_ms = ms;
+}
+
+// Called from HAL_TIM_PeriodElapsedCallback() each HAL tick (1ms, TIM1)
+void event_tick(void)
+{
+	if(event_timer_ms && !--event_timer_ms)
+		event_post(EVENT_TIMER);
+}
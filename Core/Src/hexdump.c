@@ -2,13 +2,19 @@
 // Module: hexdump.c
 #include <stdio.h>
 
+void hexdump_addr(const void* address, unsigned count, unsigned displayaddr);
+
 // Here's what I want for a hexdump() routine:
 //00000000  02 03 1f 00 0d 00 00 00  00 00 00 00 00 00 00 00  |................|
 //00000010  00 00 00 00 00 00 00 00  00 00 00 00 00 00 00 00  |................|
 void hexdump(const void* address, unsigned count) {
+    hexdump_addr(address, count, 0);
+} // hexdump()
+
+// Same as hexdump(), displaying addresses beginning at displayaddr (a device address, for example)
+void hexdump_addr(const void* address, unsigned count, unsigned displayaddr) {
     unsigned remaining = count; // bytes remaining to be displayed
     unsigned char * data = (unsigned char*)address;
-    unsigned displayaddr = 0; // starting address to display (this may be a parameter for other versions of this function)
     unsigned i;
     while (remaining) {
         unsigned thisline = remaining < 16?remaining : 16; // number of bytes to process for this line of output
@@ -46,4 +52,4 @@ void hexdump(const void* address, unsigned count) {
     }
     // Add an additional line feed if necessary
     //printf("\n");
-} // hexdump()
+} // hexdump_addr()
@@ -0,0 +1,669 @@
+// File: i2c_async.c
+//
+// Queued, interrupt driven I2C transactions on I2C1 and I2C2.
+//
+// Each bus handle (I2C_BUS) runs its own queue of transaction descriptors (I2C_XFER), so the two
+// buses transfer in parallel.  The event and error interrupts walk each transaction through the HAL
+// "sequential" API - write span, repeated START, read span, STOP - and start the next one, so queued
+// transactions run back-to-back without the main loop.  Completions run the descriptor's callback and
+// post EVENT_TASK; i2c_bus_transfer() and i2c_write_read() are the blocking forms.  Nothing here
+// prints - failures are returned, and recorded in the bus handle, trace and statistics.
+//
+// I2C1's DMA channels are the ones the USART2 console uses, hence one interrupt per byte.  Polled
+// operations hold a bus with i2c_bus_trylock() / i2c_bus_lock(); a bus that times out or faults is
+// held until i2c_bus_service() recovers it.
+
+#include <stdio.h>
+#include "main.h"   // HAL functions and defines
+#include "i2c_async.h"
+#include "events.h"
+#include "cl_i2c.h"
+#include "cl_ds3231.h"
+#include "timestamp.h"
+#include "i2c_registry.h"
+#include "i2c_trace.h"
+#include "i2c_stats.h"
+#include "i2c_recover.h"
+#include "i2c_ll.h"
+#include "i2c_pec.h"
+
+#ifdef HAL_I2C_MODULE_ENABLED
+
+// Bus handles.  Each bus has its own queue; transactions on different buses run in parallel.
+I2C_BUS i2c_bus1 = {&hi2c1, "I2C1", GPIOB, GPIO_PIN_8, GPIO_PIN_9, i2c1_reinit};
+I2C_BUS i2c_bus2 = {&hi2c2, "I2C2", GPIOB, GPIO_PIN_10, GPIO_PIN_11, i2c2_init};
+I2C_BUS * const i2c_buses[I2C_BUS_COUNT] = {&i2c_bus1, &i2c_bus2};
+
+// Return the bus owning a HAL handle, NULL if none
+static I2C_BUS * i2c_bus_from_handle(I2C_HandleTypeDef * hi2c)
+{
+	for(int i=0;i<I2C_BUS_COUNT;i++)
+		if(i2c_buses[i]->hi2c == hi2c) return i2c_buses[i];
+	return NULL;
+}
+
+// SCL speed for each device, by bus and address.  The AT24C32 needs standard mode (100KHz) at 3.3V,
+// so it uses the default.
+I2C_SPEED_ENTRY i2c_speed_table[I2C_SPEED_TABLE_SIZE] = {
+	{&i2c_bus1, I2C_ADDRESS_DS3231, 400000, I2C_DUTYCYCLE_2},
+};
+static const I2C_SPEED_ENTRY i2c_speed_default = {NULL, 0, I2C_SPEED_DEFAULT, I2C_DUTYCYCLE_2};
+
+// Return the speed table entry for a device on a bus, or the default entry
+const I2C_SPEED_ENTRY * i2c_speed_lookup(const I2C_BUS * bus, uint16_t address)
+{
+	for(int i=0;i<I2C_SPEED_TABLE_SIZE;i++)
+		if(i2c_speed_table[i].address == address && i2c_speed_table[i].bus == bus) return &i2c_speed_table[i];
+	return &i2c_speed_default;
+}
+
+// Add, change, or (clock_speed 0) remove the speed table entry of a device on a bus
+// Return 0 for success, -1 if the table is full or the speed is out of range
+int i2c_speed_set(const I2C_BUS * bus, uint16_t address, uint32_t clock_speed, uint32_t duty_cycle)
+{
+	if(clock_speed > 400000 || (clock_speed && clock_speed < 10000)) return -1;
+	I2C_SPEED_ENTRY * free_entry = NULL;
+	for(int i=0;i<I2C_SPEED_TABLE_SIZE;i++) {
+		I2C_SPEED_ENTRY * e = &i2c_speed_table[i];
+		if(e->address == address && e->bus == bus) {
+			free_entry = e;
+			break;
+		}
+		if(!e->address && !free_entry) free_entry = e;
+	}
+	if(!free_entry) return clock_speed? -1 : 0;
+	free_entry->bus = bus;
+	free_entry->address = clock_speed? address : 0;
+	free_entry->clock_speed = clock_speed;
+	free_entry->duty_cycle = clock_speed > 100000? duty_cycle : I2C_DUTYCYCLE_2;
+	return 0;
+}
+
+// SCL rate the peripheral runs at for a speed setting.  CCR counts whole PCLK1 periods, rounded up,
+// so the rate may fall short of the one asked for: 400KHz 16:9 with PCLK1 at 36MHz is CCR 4, 360KHz.
+// (SCL rise time slows the bus a little further.)
+uint32_t i2c_scl_hz(uint32_t clock_speed, uint32_t duty_cycle)
+{
+	uint32_t pclk1 = HAL_RCC_GetPCLK1Freq();
+	uint32_t ccr = I2C_SPEED(pclk1, clock_speed, duty_cycle) & I2C_CCR_CCR;
+	if(!ccr) ccr = 1;
+	if(clock_speed <= 100000) return pclk1 / (2 * ccr);        // standard mode: high = low = CCR
+	return pclk1 / ((duty_cycle == I2C_DUTYCYCLE_16_9? 25 : 3) * ccr); // fast mode: 9+16 or 1+2 CCR
+}
+
+// Reprogram the SCL clock (CCR, TRISE) if it differs from the current setting - bus must be idle
+// The peripheral must be disabled (PE=0) while CCR changes, see RM0008 I2C_CCR
+static void i2c_apply_speed(I2C_HandleTypeDef * hi2c, const I2C_SPEED_ENTRY * e)
+{
+	if(hi2c->Init.ClockSpeed == e->clock_speed && hi2c->Init.DutyCycle == e->duty_cycle) return;
+
+	// Let the previous transaction's STOP reach the bus (a few microseconds)
+	for(uint32_t i=0; (hi2c->Instance->CR1 & I2C_CR1_STOP) && i<1000; i++) ;
+
+	uint32_t pclk1 = HAL_RCC_GetPCLK1Freq();
+	__HAL_I2C_DISABLE(hi2c);
+	hi2c->Instance->TRISE = I2C_RISE_TIME(I2C_FREQRANGE(pclk1), e->clock_speed);
+	hi2c->Instance->CCR = I2C_SPEED(pclk1, e->clock_speed, e->duty_cycle);
+	__HAL_I2C_ENABLE(hi2c);
+	hi2c->Init.ClockSpeed = e->clock_speed;
+	hi2c->Init.DutyCycle = e->duty_cycle;
+}
+
+// Return non-zero while a descriptor belongs to the engine - linked into a bus's queue, waiting or on
+// the bus.  Found by walking the queues, so x may be uninitialized (a descriptor on the stack).
+int i2c_xfer_owned(const I2C_XFER * x)
+{
+	int owned = 0;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	for(int i=0;i<I2C_BUS_COUNT && !owned;i++)
+		for(const I2C_XFER * p = i2c_buses[i]->head; p; p = p->next)
+			if(p == x) {
+				owned = 1;
+				break;
+			}
+	__set_PRIMASK(primask);
+	return owned;
+}
+
+// Fill in a transaction descriptor
+// Return 0, or -1 if the engine still owns it (queued or on the bus) - left untouched, so
+// i2c_bus_submit() refuses it as well
+int i2c_xfer_init(I2C_XFER * x, uint16_t address, const uint8_t * pwrite, uint16_t wr_count, uint8_t * pread, uint16_t rd_count)
+{
+	if(i2c_xfer_owned(x)) return -1;
+	x->address = address;
+	x->pwrite = pwrite;
+	x->wr_count = pwrite? wr_count : 0;
+	x->segments = NULL;
+	x->seg_count = 0;
+	x->seg_index = 0;
+	x->pread = pread;
+	x->rd_count = pread? rd_count : 0;
+	x->callback = NULL;
+	x->context = NULL;
+	x->status = I2C_XFER_DONE;
+	x->error = 0;
+	x->bus = NULL;
+	x->next = NULL;
+	return 0;
+}
+
+// Fill in a transaction descriptor whose write span is gathered from seg_count segments, sent back to
+// back with no START between them - a register or storage address followed by data left where it
+// is (const data in flash, for example), with no staging copy.  Empty segments are skipped.
+// Return 0, or -1 if there are more than I2C_SEGMENTS_MAX segments, or the engine still owns x
+int i2c_xfer_init_segments(I2C_XFER * x, uint16_t address, const I2C_SEGMENT * segments, uint8_t seg_count,
+		uint8_t * pread, uint16_t rd_count)
+{
+	if(i2c_xfer_init(x, address, NULL, 0, pread, rd_count)) return -1;
+	if(seg_count > I2C_SEGMENTS_MAX) return -1;
+	x->segments = segments;
+	x->seg_count = seg_count;
+	for(int i=0;i<seg_count;i++) x->wr_count += segments[i].count;
+	return 0;
+}
+
+// Time allowed for a blocking transaction of "bytes" bytes (written plus read) with a device:
+// I2C_TIMEOUT_MARGIN times the ideal time on the wire at the device's SCL speed (9 clocks per byte,
+// plus address bytes, START and STOP), an I2C_STRETCH_US allowance per byte for clock stretching,
+// and I2C_TIMEOUT_MIN_MS.  A one byte register read at 400KHz gets 3ms; 256 bytes at 100KHz, 75ms.
+uint32_t i2c_timeout_ms(const I2C_BUS * bus, uint16_t address, uint32_t bytes)
+{
+	uint32_t bits = 9 * (bytes + 2) + 3; // two address bytes (repeated START), START, STOP
+	uint32_t wire_us = (uint32_t)((uint64_t)bits * 1000000 / i2c_speed_lookup(bus, address)->clock_speed);
+	uint32_t us = wire_us * I2C_TIMEOUT_MARGIN + bytes * I2C_STRETCH_US;
+	return I2C_TIMEOUT_MIN_MS + (us + 999) / 1000;
+}
+
+static void i2c_start(I2C_BUS * bus);
+
+// Return the index of the first non-empty segment at or after i, seg_count if none
+static uint8_t i2c_segment_next(const I2C_XFER * x, uint8_t i)
+{
+	while(i < x->seg_count && !x->segments[i].count) i++;
+	return i;
+}
+
+// Put the next piece of the write span on the bus: all of pwrite, or segment x->seg_index
+// The first piece generates START, following pieces continue the same frame (I2C_NEXT_FRAME).  The
+// last piece ends with STOP, unless a read follows (repeated START, see the receive callback).
+// Interrupt context, or interrupts masked
+static HAL_StatusTypeDef i2c_write_next(I2C_BUS * bus, I2C_XFER * x, int first)
+{
+	const uint8_t * data = x->pwrite;
+	uint16_t count = x->wr_count;
+	int last = 1;
+	if(x->seg_count) {
+		data = x->segments[x->seg_index].data;
+		count = x->segments[x->seg_index].count;
+		last = i2c_segment_next(x, x->seg_index + 1) >= x->seg_count;
+	}
+	uint32_t options = first? (last && !x->rd_count? I2C_FIRST_AND_LAST_FRAME : I2C_FIRST_FRAME) :
+			(last && !x->rd_count? I2C_LAST_FRAME : I2C_NEXT_FRAME);
+	return HAL_I2C_Master_Seq_Transmit_IT(bus->hi2c, x->address<<1, (uint8_t *)data, count, options);
+}
+
+// Count a finished transaction against its bus, and (I2C1) update the device registry
+static void i2c_bus_record(I2C_BUS * bus, uint16_t address, int8_t status, uint32_t error)
+{
+	bus->transactions++;
+	if(status != I2C_XFER_DONE) {
+		// Recorded for i2cbus - reporting is left to the caller, outside interrupt context
+		bus->failures++;
+		bus->last_status = status;
+		bus->last_error = error;
+		bus->last_address = address;
+	}
+	if(bus == &i2c_bus1)
+		i2c_registry_update(address, status == I2C_XFER_DONE? I2C_DEVICE_PRESENT :
+				(error & HAL_I2C_ERROR_AF)? I2C_DEVICE_ABSENT : I2C_DEVICE_UNKNOWN);
+}
+
+// Remove the bus's active transaction from its queue, report its status, and start the next one
+// Interrupt context, or interrupts masked
+static void i2c_complete(I2C_BUS * bus, int8_t status)
+{
+	I2C_XFER * x = bus->head;
+	if(!x) return;
+	bus->head = x->next;
+	if(!bus->head) bus->tail = NULL;
+	x->next = NULL;
+	x->error = status == I2C_XFER_ERROR? bus->hi2c->ErrorCode : 0;
+	i2c_bus_record(bus, x->address, status, x->error);
+	const uint8_t * lead = x->pwrite;
+	uint8_t gathered[I2C_TRACE_DATA];
+	if(x->seg_count) {
+		// Leading bytes of a gathered write, for the trace
+		unsigned n = 0;
+		for(int i=0;i<x->seg_count && n<I2C_TRACE_DATA;i++)
+			for(uint16_t j=0;j<x->segments[i].count && n<I2C_TRACE_DATA;j++)
+				gathered[n++] = x->segments[i].data[j];
+		lead = gathered;
+	}
+	i2c_trace_record(x->start_us, x->address, bus == &i2c_bus2? I2C_TRACE_BUS2 : 0, lead, x->wr_count,
+			x->pread, x->rd_count, status, x->error);
+	i2c_stats_record(bus == &i2c_bus2, x->address, x->wr_count, status == I2C_XFER_DONE? x->rd_count : 0,
+			status == I2C_XFER_DONE? I2C_STATS_OK : status == I2C_XFER_TIMEOUT? I2C_STATS_TIMEOUT :
+			(x->error & HAL_I2C_ERROR_AF)? I2C_STATS_NACK : I2C_STATS_BUS_ERROR, timestamp_us() - x->start_us);
+	// Timeout, bus error, arbitration lost: the bus may be wedged.  Hold it - before the callback can
+	// submit more - until i2c_bus_service() has recovered it.
+	uint8_t hold = status == I2C_XFER_TIMEOUT || (x->error & (HAL_I2C_ERROR_BERR | HAL_I2C_ERROR_ARLO));
+	if(hold) {
+		bus->locked = 1;
+		bus->recover = status == I2C_XFER_TIMEOUT? I2C_RECOVER_TIMEOUT : I2C_RECOVER_ERROR;
+		bus->deferred_since = timestamp_us();
+	}
+	x->status = status;
+	if(x->callback) x->callback(x); // may submit another transaction
+	event_post(hold? EVENT_TASK | EVENT_I2C : EVENT_TASK);
+	i2c_start(bus);
+}
+
+// Start the transaction at the head of the bus's queue, if the bus is idle
+// Interrupt context, or interrupts masked
+static void i2c_start(I2C_BUS * bus)
+{
+	I2C_XFER * x = bus->head;
+	if(!x || x->status != I2C_XFER_QUEUED || bus->locked) return; // idle, already on the bus, or held
+
+	HAL_StatusTypeDef rc;
+	x->status = I2C_XFER_ACTIVE;
+	i2c_apply_speed(bus->hi2c, i2c_speed_lookup(bus, x->address));
+	x->start_us = timestamp_us();
+	x->seg_index = i2c_segment_next(x, 0);
+	if(x->wr_count)
+		rc = i2c_write_next(bus, x, 1);
+	else
+		rc = HAL_I2C_Master_Seq_Receive_IT(bus->hi2c, x->address<<1, x->pread, x->rd_count, I2C_FIRST_AND_LAST_FRAME);
+	if(HAL_OK != rc)
+		i2c_complete(bus, I2C_XFER_ERROR); // peripheral busy (polled HAL call?) - fail this one, try the next
+}
+
+// Queue a transaction on a bus
+// Return 0 if queued, -1 if the descriptor is invalid or still queued / on the bus - status above
+// I2C_XFER_DONE, which i2c_xfer_init() leaves in place until the engine hands the descriptor back
+int i2c_bus_submit(I2C_BUS * bus, I2C_XFER * x)
+{
+	if(x->status > I2C_XFER_DONE || (!x->wr_count && !x->rd_count)) return -1;
+
+	// Idle queue, thread context: nothing of ours holds the bus, so BUSY is a lock-up
+	if(!bus->head && !__get_IPSR() && (bus->hi2c->Instance->SR2 & I2C_SR2_BUSY) && !i2c_bus_trylock(bus)) {
+		if(i2c_bus_stuck(bus))
+			i2c_bus_recover(bus, I2C_RECOVER_BUSY);
+		i2c_bus_unlock(bus);
+	}
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if(bus->locked) {
+		// Held by a polled operation - started by i2c_bus_unlock()
+		if(!bus->head) bus->deferred_since = timestamp_us();
+		bus->deferred++;
+	}
+	x->bus = bus;
+	x->status = I2C_XFER_QUEUED;
+	x->next = NULL;
+	if(bus->tail)
+		bus->tail->next = x;
+	else
+		bus->head = x;
+	bus->tail = x;
+	i2c_start(bus);
+	__set_PRIMASK(primask);
+	return 0;
+}
+
+// Queue a transaction on I2C1
+int i2c_submit(I2C_XFER * x)
+{
+	return i2c_bus_submit(&i2c_bus1, x);
+}
+
+// Take back a submitted transaction that is no longer wanted - timed out, or its task was cancelled.
+// A queued transaction is unlinked.  The active one is aborted (STOP), completing through
+// HAL_I2C_AbortCpltCallback(); if the peripheral is wedged and the abort does not complete, it is
+// dropped.  Either way its status is I2C_XFER_TIMEOUT, unless it completed in the meantime.
+// Thread context.  On return the descriptor belongs to the caller again (status <= I2C_XFER_DONE).
+void i2c_cancel(I2C_XFER * x)
+{
+	I2C_BUS * bus = x->bus;
+	if(x->status <= I2C_XFER_DONE || !bus) return; // never submitted, or already complete
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if(x->status == I2C_XFER_QUEUED) {
+		// Not started, unlink it
+		I2C_XFER * prev = NULL;
+		for(I2C_XFER * p = bus->head; p; prev = p, p = p->next) {
+			if(p != x) continue;
+			if(prev) prev->next = x->next; else bus->head = x->next;
+			if(bus->tail == x) bus->tail = prev;
+			break;
+		}
+		x->next = NULL;
+		x->status = I2C_XFER_TIMEOUT;
+	}
+	else if(x->status == I2C_XFER_ACTIVE && x == bus->head) {
+		if(HAL_OK != HAL_I2C_Master_Abort_IT(bus->hi2c, x->address<<1))
+			i2c_complete(bus, I2C_XFER_TIMEOUT); // nothing in progress to abort, move on
+	}
+	__set_PRIMASK(primask);
+
+	// Abort completes within a byte time.  If the peripheral is wedged, drop the transaction.
+	uint32_t start = HAL_GetTick();
+	while(x->status > I2C_XFER_DONE && HAL_GetTick() - start < 3) ;
+	__disable_irq();
+	if(x->status > I2C_XFER_DONE && x == bus->head) i2c_complete(bus, I2C_XFER_TIMEOUT);
+	__set_PRIMASK(primask);
+}
+
+// Wait for a submitted transaction to complete, sleeping between interrupts
+// Thread context only.  Return I2C_XFER_DONE (0) for success, else I2C_XFER_ERROR or I2C_XFER_TIMEOUT
+int i2c_wait(I2C_XFER * x, uint32_t timeout_ms)
+{
+	I2C_BUS * bus = x->bus;
+	uint32_t start = HAL_GetTick();
+	while(1) {
+		__disable_irq();
+		if(x->status <= I2C_XFER_DONE) break;
+		if(bus->recover) {
+			// An earlier transaction's failure holds the bus, with this one queued behind - recover it now
+			__enable_irq();
+			i2c_bus_service(bus);
+			continue;
+		}
+		__WFI(); // I2C or HAL tick interrupt wakes the core
+		__enable_irq();
+		if(HAL_GetTick() - start > timeout_ms && x->status > I2C_XFER_DONE) {
+			i2c_cancel(x);
+			break;
+		}
+	}
+	__enable_irq();
+	// Timeout or bus fault: i2c_complete() held the bus, recover it before returning.  Otherwise (a
+	// NACK, or taken back while still queued) free the bus if it was left BUSY.
+	if(x->status < I2C_XFER_DONE && !i2c_bus_service(bus) && !i2c_bus_trylock(bus)) {
+		if(i2c_bus_stuck(bus))
+			i2c_bus_recover(bus, x->status == I2C_XFER_TIMEOUT? I2C_RECOVER_TIMEOUT : I2C_RECOVER_ERROR);
+		i2c_bus_unlock(bus);
+	}
+	return x->status;
+}
+
+// Recover a bus that i2c_complete() held after a timeout or bus fault, then release it - starting
+// the transactions queued in the meantime
+// Thread context.  Return non-zero if the bus was held for recovery.
+int i2c_bus_service(I2C_BUS * bus)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	uint8_t reason = bus->recover;
+	bus->recover = 0;
+	__set_PRIMASK(primask);
+	if(!reason) return 0;
+	i2c_bus_recover(bus, reason);
+	i2c_bus_unlock(bus);
+	return 1;
+}
+
+// Main loop, EVENT_I2C - recover any bus held after a timeout or bus fault
+void i2c_service(void)
+{
+	for(int i=0;i<I2C_BUS_COUNT;i++)
+		i2c_bus_service(i2c_buses[i]);
+}
+
+// Submit a transaction on a bus and wait for it to complete
+// Thread context only.  Return I2C_XFER_DONE (0) for success, else I2C_XFER_ERROR or I2C_XFER_TIMEOUT
+int i2c_bus_transfer(I2C_BUS * bus, I2C_XFER * x, uint32_t timeout_ms)
+{
+	if(i2c_bus_submit(bus, x)) return I2C_XFER_ERROR;
+	return i2c_wait(x, timeout_ms);
+}
+
+// Submit a transaction on I2C1 and wait for it to complete
+int i2c_transfer(I2C_XFER * x, uint32_t timeout_ms)
+{
+	return i2c_bus_transfer(&i2c_bus1, x, timeout_ms);
+}
+
+// Write, repeated START, read - one transaction, either span may be empty
+// Thread context only.  Nothing is printed; the failure is returned, and recorded in the bus handle.
+// With I2C_LL_FAST_PATH, short I2C1 transactions are run by the polled register level path (i2c_ll.c)
+// instead of the interrupt driven HAL engine, if i2c_bus_trylock() finds the bus free.  Otherwise
+// they join the queue rather than wait for it.
+// Return I2C_XFER_DONE (0) for success, else I2C_XFER_ERROR (invalid address, NACK, bus error)
+// or I2C_XFER_TIMEOUT
+int i2c_write_read(I2C_BUS * bus, uint16_t address, const uint8_t * pwrite, uint16_t wr_count, uint8_t * pread, uint16_t rd_count)
+{
+	if(address < I2C_ADDRESS_MIN || address > I2C_ADDRESS_MAX) return I2C_XFER_ERROR;
+
+#if I2C_LL_FAST_PATH
+	if(bus == &i2c_bus1 && (wr_count || rd_count) &&
+			(uint32_t)(pwrite? wr_count : 0) + (pread? rd_count : 0) <= I2C_LL_FAST_MAX && !i2c_bus_trylock(bus)) {
+		// Nothing of ours is on the bus, so BUSY is a lock-up - as i2c_bus_submit()
+		if((bus->hi2c->Instance->SR2 & I2C_SR2_BUSY) && i2c_bus_stuck(bus))
+			i2c_bus_recover(bus, I2C_RECOVER_BUSY);
+		i2c_apply_speed(bus->hi2c, i2c_speed_lookup(bus, address));
+		int rc = i2c_ll_write_read(bus->hi2c, address, pwrite, pwrite? wr_count : 0, pread, pread? rd_count : 0);
+		i2c_bus_record(bus, address, rc, rc? bus->hi2c->ErrorCode : 0);
+		if(rc && (bus->hi2c->ErrorCode & (HAL_I2C_ERROR_BERR | HAL_I2C_ERROR_ARLO | HAL_I2C_ERROR_TIMEOUT)) &&
+				i2c_bus_stuck(bus))
+			i2c_bus_recover(bus, I2C_RECOVER_ERROR);
+		i2c_bus_unlock(bus);
+		return rc;
+	}
+#endif // I2C_LL_FAST_PATH
+
+	I2C_XFER xfer;
+	i2c_xfer_init(&xfer, address, pwrite, wr_count, pread, rd_count);
+	if(!xfer.wr_count && !xfer.rd_count) return I2C_XFER_DONE; // nothing to do
+	return i2c_bus_transfer(bus, &xfer, i2c_timeout_ms(bus, address, xfer.wr_count + xfer.rd_count));
+}
+
+// Gathered write - one transaction sending each segment in turn, see i2c_xfer_init_segments()
+// Thread context only.  Nothing is printed; the failure is returned, and recorded in the bus handle.
+// Return I2C_XFER_DONE (0) for success, else I2C_XFER_ERROR or I2C_XFER_TIMEOUT
+int i2c_write_segments(I2C_BUS * bus, uint16_t address, const I2C_SEGMENT * segments, uint8_t seg_count)
+{
+	if(address < I2C_ADDRESS_MIN || address > I2C_ADDRESS_MAX) return I2C_XFER_ERROR;
+
+	I2C_XFER xfer;
+	if(i2c_xfer_init_segments(&xfer, address, segments, seg_count, NULL, 0)) return I2C_XFER_ERROR;
+	if(!xfer.wr_count) return I2C_XFER_DONE; // nothing to do
+	return i2c_bus_transfer(bus, &xfer, i2c_timeout_ms(bus, address, xfer.wr_count));
+}
+
+// SMBus transaction with packet error checking: write, repeated START, read - either span may be empty
+// A PEC byte (CRC-8 of the whole transaction, address bytes included, see i2c_pec.c) follows the write
+// span of a write-only transaction, or the read span.  With I2C_PEC_HARDWARE, the peripheral's PEC
+// calculator checks it (i2c_ll_write_read_pec()) if i2c_bus_trylock() finds the bus free; otherwise
+// it joins the queue and the table checks it.  Up to I2C_PEC_DATA_MAX bytes may be read.
+// Thread context only.  Return I2C_XFER_DONE (0), I2C_XFER_PEC if the device's PEC did not match (the
+// data is returned regardless), else I2C_XFER_ERROR or I2C_XFER_TIMEOUT
+int i2c_write_read_pec(I2C_BUS * bus, uint16_t address, const uint8_t * pwrite, uint16_t wr_count, uint8_t * pread, uint16_t rd_count)
+{
+	if(!pwrite) wr_count = 0;
+	if(!pread) rd_count = 0;
+	if(address < I2C_ADDRESS_MIN || address > I2C_ADDRESS_MAX || rd_count > I2C_PEC_DATA_MAX) return I2C_XFER_ERROR;
+	if(!wr_count && !rd_count) return I2C_XFER_DONE; // nothing to do
+
+	uint8_t buf[I2C_PEC_DATA_MAX + 1]; // read span and the device's PEC
+	int rc, hardware = 0;
+#if I2C_PEC_HARDWARE
+	if(i2c_pec_hardware && !i2c_bus_trylock(bus)) {
+		hardware = 1;
+		if((bus->hi2c->Instance->SR2 & I2C_SR2_BUSY) && i2c_bus_stuck(bus))
+			i2c_bus_recover(bus, I2C_RECOVER_BUSY); // as i2c_write_read()
+		i2c_apply_speed(bus->hi2c, i2c_speed_lookup(bus, address));
+		rc = i2c_ll_write_read_pec(bus->hi2c, address, pwrite, wr_count, buf, rd_count);
+		// On the bus the transaction succeeded - a PEC mismatch is counted by i2c_pec_record()
+		i2c_bus_record(bus, address, rc == I2C_XFER_PEC? I2C_XFER_DONE : rc, rc == I2C_XFER_ERROR? bus->hi2c->ErrorCode : 0);
+		if(rc == I2C_XFER_ERROR && (bus->hi2c->ErrorCode & (HAL_I2C_ERROR_BERR | HAL_I2C_ERROR_ARLO | HAL_I2C_ERROR_TIMEOUT)) &&
+				i2c_bus_stuck(bus))
+			i2c_bus_recover(bus, I2C_RECOVER_ERROR);
+		i2c_bus_unlock(bus);
+	}
+	else
+#endif // I2C_PEC_HARDWARE
+	if(!rd_count) {
+		uint8_t pec = i2c_pec_message(address, pwrite, wr_count, NULL, 0);
+		I2C_SEGMENT segments[2] = {{pwrite, wr_count}, {&pec, 1}};
+		rc = i2c_write_segments(bus, address, segments, 2);
+	}
+	else {
+		rc = i2c_write_read(bus, address, pwrite, wr_count, buf, rd_count + 1);
+		if(rc == I2C_XFER_DONE && buf[rd_count] != i2c_pec_message(address, pwrite, wr_count, buf, rd_count))
+			rc = I2C_XFER_PEC;
+	}
+
+	i2c_pec_record(bus == &i2c_bus2, address, hardware, rc);
+	if(rd_count && (rc == I2C_XFER_DONE || rc == I2C_XFER_PEC))
+		for(uint16_t i=0;i<rd_count;i++) pread[i] = buf[i];
+	return rc;
+}
+
+// Return non-zero while transactions are queued or active on a bus, or a polled operation holds it
+int i2c_bus_busy(const I2C_BUS * bus)
+{
+	return bus->head != NULL || bus->locked;
+}
+
+// Grant the bus to a polled operation if its queue is empty and no one holds it - interrupts masked
+// Return 0 if granted
+static int i2c_bus_acquire(I2C_BUS * bus)
+{
+	if(bus->head || bus->locked) return -1;
+	bus->locked = 1;
+	bus->locks++;
+	return 0;
+}
+
+// Take a bus for a polled operation, without waiting - any context
+// Until i2c_bus_unlock(), transactions submitted to the bus are queued but not started.
+// Return 0 if the bus is now held, -1 if the queue is busy or the bus is already held
+int i2c_bus_trylock(I2C_BUS * bus)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	int rc = i2c_bus_acquire(bus);
+	if(rc) bus->contended++;
+	__set_PRIMASK(primask);
+	return rc;
+}
+
+// Take a bus for a polled operation, sleeping until its queue drains
+// Thread context; from an interrupt handler this is i2c_bus_trylock().
+// Return 0 if the bus is now held, -1 if it did not come free within timeout_ms
+int i2c_bus_lock(I2C_BUS * bus, uint32_t timeout_ms)
+{
+	if(!i2c_bus_trylock(bus)) return 0;
+	if(__get_IPSR()) return -1;
+	uint32_t start = HAL_GetTick();
+	int rc = -1;
+	while(rc && HAL_GetTick() - start <= timeout_ms) {
+		i2c_bus_service(bus); // held for recovery - recover it, rather than wait it out
+		__disable_irq();
+		rc = i2c_bus_acquire(bus);
+		if(rc) __WFI(); // I2C completion or HAL tick interrupt wakes the core
+		__enable_irq();
+	}
+	return rc;
+}
+
+// Release a bus taken with i2c_bus_trylock() or i2c_bus_lock(), starting any transactions
+// submitted while it was held
+void i2c_bus_unlock(I2C_BUS * bus)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	bus->locked = 0;
+	if(bus->head) {
+		uint32_t waited = timestamp_us() - bus->deferred_since;
+		if(waited > bus->deferred_max_us) bus->deferred_max_us = waited;
+		i2c_start(bus);
+	}
+	__set_PRIMASK(primask);
+}
+
+// Probe a held bus at the device's SCL speed (as a transaction with it would run), then release it
+static int i2c_bus_probe_held(I2C_BUS * bus, uint16_t address)
+{
+	i2c_apply_speed(bus->hi2c, i2c_speed_lookup(bus, address));
+	int rc = i2c_ll_probe(bus->hi2c, address);
+	i2c_bus_unlock(bus);
+	return rc;
+}
+
+// Probe a device address at register level (i2c_ll_probe()), holding the bus for the probe only
+// Thread context.  Return I2C_LL_ACK, I2C_LL_NACK, or I2C_LL_ERROR (bus error, or not available)
+int i2c_bus_probe(I2C_BUS * bus, uint16_t address)
+{
+	if(i2c_bus_lock(bus, I2C_LOCK_TIMEOUT_MS)) return I2C_LL_ERROR;
+	return i2c_bus_probe_held(bus, address);
+}
+
+// As i2c_bus_probe(), without waiting for the bus - ACK polling from a task, for example
+// Return I2C_LL_ACK, I2C_LL_NACK, or I2C_LL_ERROR (bus error, or the bus is busy)
+int i2c_bus_tryprobe(I2C_BUS * bus, uint16_t address)
+{
+	if(i2c_bus_trylock(bus)) return I2C_LL_ERROR;
+	return i2c_bus_probe_held(bus, address);
+}
+
+// Return non-zero while transactions are queued or active on I2C1
+int i2c_async_busy(void)
+{
+	return i2c_bus_busy(&i2c_bus1);
+}
+
+// HAL callback, I2C interrupt context - write span (or one segment of it) sent
+void HAL_I2C_MasterTxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+	I2C_BUS * bus = i2c_bus_from_handle(hi2c);
+	if(!bus || !bus->head) return;
+	I2C_XFER * x = bus->head;
+	if(x->seg_count) {
+		// Gathered write - continue with the next segment, if any
+		x->seg_index = i2c_segment_next(x, x->seg_index + 1);
+		if(x->seg_index < x->seg_count) {
+			if(HAL_OK != i2c_write_next(bus, x, 0))
+				i2c_complete(bus, I2C_XFER_ERROR);
+			return;
+		}
+	}
+	if(!x->rd_count) {
+		i2c_complete(bus, I2C_XFER_DONE);
+		return;
+	}
+	// Repeated START, read span, STOP
+	if(HAL_OK != HAL_I2C_Master_Seq_Receive_IT(hi2c, x->address<<1, x->pread, x->rd_count, I2C_LAST_FRAME))
+		i2c_complete(bus, I2C_XFER_ERROR);
+}
+
+// HAL callback, I2C interrupt context - read span received
+void HAL_I2C_MasterRxCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+	I2C_BUS * bus = i2c_bus_from_handle(hi2c);
+	if(!bus) return;
+	i2c_complete(bus, I2C_XFER_DONE);
+}
+
+// HAL callback, I2C interrupt context - NACK, bus error, arbitration lost, overrun
+// The HAL has already generated STOP (for NACK) and returned the handle to ready
+void HAL_I2C_ErrorCallback(I2C_HandleTypeDef *hi2c)
+{
+	I2C_BUS * bus = i2c_bus_from_handle(hi2c);
+	if(!bus) return;
+	i2c_complete(bus, I2C_XFER_ERROR);
+}
+
+// HAL callback, I2C interrupt context - HAL_I2C_Master_Abort_IT() completed
+void HAL_I2C_AbortCpltCallback(I2C_HandleTypeDef *hi2c)
+{
+	I2C_BUS * bus = i2c_bus_from_handle(hi2c);
+	if(!bus) return;
+	i2c_complete(bus, I2C_XFER_TIMEOUT);
+}
+
+#endif // HAL_I2C_MODULE_ENABLED
@@ -0,0 +1,332 @@
+// File: i2c_ll.c
+//
+// Register level I2C operations (RM0008, chapter 26), for sequences where the HAL's tick based
+// timeouts dominate the time spent.
+//
+// i2c_ll_probe() addresses a device (START, address + write, STOP) and reports whether it
+// acknowledged.  HAL_I2C_IsDeviceReady() does the same, but waits on HAL_GetTick() based timeouts
+// and delays between trials.  Here a NACK (AF flag) ends the probe as soon as the ninth clock
+// completes, and each flag wait is bounded with the DWT cycle counter instead of the 1ms tick.
+//
+// i2c_ll_write_read() is a polled write / repeated START / read transaction, for the 1 to 3 byte
+// register accesses that make up most DS3231 and sensor traffic.  At 400KHz such a transaction is
+// on the bus for 70-120us, and the HAL's per-call locking, state checks and tick based flag waits
+// are a large share of that.  The receive side follows RM0008's three reception sequences (26.3.3,
+// "Master receiver"), which differ in when ACK is cleared and STOP is set:
+//   1 byte:  clear ACK before clearing ADDR, then STOP - interrupts off across the pair
+//   2 bytes: POS and ACK before ADDR, clear ACK after ADDR, wait BTF, then STOP and read both
+//   N > 2:   read until 3 bytes remain, wait BTF, clear ACK, read N-2, STOP, read N-1, then read N
+// i2c_write_read() (i2c_async.c) uses it for I2C1 transactions of up to I2C_LL_FAST_MAX bytes when
+// the queue is idle and I2C_LL_FAST_PATH is set.  "i2cbench" compares it with the HAL.
+//
+// i2c_ll_write_read_pec() is the same transaction with SMBus packet error checking done by the
+// peripheral (CR1 ENPEC): the PEC is calculated as bytes cross the bus, costing the CPU nothing per
+// byte.  See i2c_pec.c for the table driven software form.
+//
+// The caller must hold the bus (i2c_bus_trylock() or i2c_bus_lock(), i2c_async.c), so no interrupt
+// driven transfer is in progress or starts part way through.  The HAL handle is also marked busy for
+// the duration, so HAL calls made meanwhile fail rather than interfere.
+
+#include <stdio.h>
+#include <stdlib.h> // strtol()
+#include "main.h"   // HAL functions and defines
+#include "i2c_ll.h"
+#include "timestamp.h"
+#include "i2c_trace.h"
+#include "i2c_stats.h"
+#include "i2c_async.h"
+#include "cl_i2c.h"
+#include "command_line.h"
+
+#ifdef HAL_I2C_MODULE_ENABLED
+
+/* To implement the expected functionality, the following lines would be added to
+   command_line.c, in the cmd_table[]:
+
+#ifdef HAL_I2C_MODULE_ENABLED
+	{"i2cbench",  "i2cbench <i2c address> <register> <count 1-3>", 3, cl_i2c_ll_bench},
+#endif // HAL_I2C_MODULE_ENABLED
+
+*/
+
+// Wait until any of the SR1 flags are set, or an error occurs
+// Return the SR1 value, or 0 on timeout
+static uint32_t i2c_ll_wait_sr1(I2C_TypeDef * i2c, uint32_t flags, uint32_t start, uint32_t limit)
+{
+	while(1) {
+		uint32_t sr1 = i2c->SR1;
+		if(sr1 & (flags | I2C_SR1_BERR | I2C_SR1_ARLO)) return sr1;
+		if(timestamp_cycles() - start > limit) return 0;
+	}
+}
+
+// Probe a 7-bit address, return I2C_LL_ACK, I2C_LL_NACK, or I2C_LL_ERROR
+int i2c_ll_probe(I2C_HandleTypeDef * hi2c, uint16_t address)
+{
+	I2C_TypeDef * i2c = hi2c->Instance;
+	uint32_t limit = (SystemCoreClock / 1000000) * I2C_LL_TIMEOUT_US; // CPU cycles
+	uint32_t start = timestamp_cycles();
+	uint32_t start_us = timestamp_us();
+	int rc = I2C_LL_ERROR;
+	uint32_t error = HAL_I2C_ERROR_TIMEOUT; // for the trace, HAL_I2C_ERROR_xxx bits as an engine failure
+
+	if(hi2c->State != HAL_I2C_STATE_READY || (i2c->SR2 & I2C_SR2_BUSY)) return I2C_LL_ERROR;
+	hi2c->State = HAL_I2C_STATE_BUSY;
+
+	i2c->CR1 &= ~I2C_CR1_POS;
+	i2c->CR1 |= I2C_CR1_START;
+	uint32_t sr1 = i2c_ll_wait_sr1(i2c, I2C_SR1_SB, start, limit);
+	if(sr1 & I2C_SR1_SB) {
+		i2c->DR = (uint8_t)(address << 1); // write direction - reading SR1, then writing DR clears SB
+		sr1 = i2c_ll_wait_sr1(i2c, I2C_SR1_ADDR | I2C_SR1_AF, start, limit);
+		if(sr1 & I2C_SR1_ADDR) {
+			(void)i2c->SR2; // reading SR1, then SR2 clears ADDR
+			rc = I2C_LL_ACK;
+		}
+		else if(sr1 & I2C_SR1_AF) {
+			rc = I2C_LL_NACK;
+		}
+	}
+	if(rc == I2C_LL_ACK) error = 0;
+	else if(rc == I2C_LL_NACK) error = HAL_I2C_ERROR_AF;
+	else if(sr1 & (I2C_SR1_BERR | I2C_SR1_ARLO)) error = (sr1 & I2C_SR1_BERR? HAL_I2C_ERROR_BERR : 0) | (sr1 & I2C_SR1_ARLO? HAL_I2C_ERROR_ARLO : 0);
+	i2c->CR1 |= I2C_CR1_STOP;
+	__HAL_I2C_CLEAR_FLAG(hi2c, I2C_FLAG_AF);
+	__HAL_I2C_CLEAR_FLAG(hi2c, I2C_FLAG_BERR);
+	__HAL_I2C_CLEAR_FLAG(hi2c, I2C_FLAG_ARLO);
+	// Wait for the STOP to complete (hardware clears the STOP bit)
+	while((i2c->CR1 & I2C_CR1_STOP) && timestamp_cycles() - start <= limit) ;
+
+	hi2c->State = HAL_I2C_STATE_READY;
+	// Traced with the engine's status values - a NACK is I2C_XFER_ERROR with HAL_I2C_ERROR_AF, as for
+	// any other transaction, not I2C_LL_NACK (0, which reads as I2C_XFER_DONE)
+	i2c_trace_record(start_us, address, I2C_TRACE_PROBE, NULL, 0, NULL, 0,
+			rc == I2C_LL_ACK? I2C_XFER_DONE : I2C_XFER_ERROR, error);
+	i2c_stats_record(hi2c->Instance == I2C2, address, 0, 0, rc == I2C_LL_ACK? I2C_STATS_OK : rc == I2C_LL_NACK? I2C_STATS_NACK : I2C_STATS_BUS_ERROR,
+			timestamp_us() - start_us);
+	return rc;
+}
+
+// Wait for SR1 flags, each wait bounded by I2C_LL_TIMEOUT_US
+// Return non-zero if a flag in "flags" is set.  Otherwise record the failure in hi2c->ErrorCode.
+static int i2c_ll_wait(I2C_HandleTypeDef * hi2c, uint32_t flags)
+{
+	uint32_t sr1 = i2c_ll_wait_sr1(hi2c->Instance, flags | I2C_SR1_AF, timestamp_cycles(),
+			(SystemCoreClock / 1000000) * I2C_LL_TIMEOUT_US);
+	if(sr1 & flags) return 1;
+	hi2c->ErrorCode |= !sr1? HAL_I2C_ERROR_TIMEOUT : (sr1 & I2C_SR1_AF)? HAL_I2C_ERROR_AF :
+			(sr1 & I2C_SR1_ARLO)? HAL_I2C_ERROR_ARLO : HAL_I2C_ERROR_BERR;
+	return 0;
+}
+
+// START (or repeated START), then the address byte.  Return non-zero once ADDR is set (not cleared).
+static int i2c_ll_address(I2C_HandleTypeDef * hi2c, uint8_t address_byte)
+{
+	hi2c->Instance->CR1 |= I2C_CR1_START;
+	if(!i2c_ll_wait(hi2c, I2C_SR1_SB)) return 0;
+	hi2c->Instance->DR = address_byte; // reading SR1, then writing DR clears SB
+	return i2c_ll_wait(hi2c, I2C_SR1_ADDR);
+}
+
+// Receive count bytes after the address byte - RM0008 master receiver sequences
+// Return non-zero for success.  STOP has been set either way.
+static int i2c_ll_receive(I2C_HandleTypeDef * hi2c, uint8_t * pread, uint16_t count)
+{
+	I2C_TypeDef * i2c = hi2c->Instance;
+	uint32_t primask;
+
+	if(count == 1) {
+		i2c->CR1 &= ~I2C_CR1_ACK;
+		primask = __get_PRIMASK();
+		__disable_irq();
+		(void)i2c->SR2; // clear ADDR - the byte is now clocked in, NACKed
+		i2c->CR1 |= I2C_CR1_STOP;
+		__set_PRIMASK(primask);
+		if(!i2c_ll_wait(hi2c, I2C_SR1_RXNE)) return 0;
+		*pread = (uint8_t)i2c->DR;
+		return 1;
+	}
+	if(count == 2) {
+		// POS and ACK were set before the address byte (see i2c_ll_write_read())
+		primask = __get_PRIMASK();
+		__disable_irq();
+		(void)i2c->SR2; // clear ADDR
+		i2c->CR1 &= ~I2C_CR1_ACK; // NACK applies to the second byte (POS)
+		__set_PRIMASK(primask);
+		if(!i2c_ll_wait(hi2c, I2C_SR1_BTF)) { i2c->CR1 |= I2C_CR1_STOP; return 0; }
+		primask = __get_PRIMASK();
+		__disable_irq();
+		i2c->CR1 |= I2C_CR1_STOP;
+		pread[0] = (uint8_t)i2c->DR;
+		__set_PRIMASK(primask);
+		pread[1] = (uint8_t)i2c->DR;
+		return 1;
+	}
+
+	(void)i2c->SR2; // clear ADDR, ACK is set
+	while(count > 3) {
+		if(!i2c_ll_wait(hi2c, I2C_SR1_RXNE)) { i2c->CR1 |= I2C_CR1_STOP; return 0; }
+		*pread++ = (uint8_t)i2c->DR;
+		count--;
+	}
+	// Three left: N-2 in DR, N-1 in the shift register once BTF is set
+	if(!i2c_ll_wait(hi2c, I2C_SR1_BTF)) { i2c->CR1 |= I2C_CR1_STOP; return 0; }
+	i2c->CR1 &= ~I2C_CR1_ACK;
+	primask = __get_PRIMASK();
+	__disable_irq();
+	*pread++ = (uint8_t)i2c->DR;
+	i2c->CR1 |= I2C_CR1_STOP;
+	*pread++ = (uint8_t)i2c->DR;
+	__set_PRIMASK(primask);
+	if(!i2c_ll_wait(hi2c, I2C_SR1_RXNE)) return 0;
+	*pread = (uint8_t)i2c->DR;
+	return 1;
+}
+
+// Polled write, repeated START, read - either span may be empty (not both)
+// With pec set, the peripheral's PEC calculator runs across the whole transaction (address bytes
+// included): a write-only transaction ends with the calculated PEC byte, and the last byte of a read
+// must be the device's PEC - the calculator holds 0 once it has taken in a correct one.
+// Return I2C_XFER_DONE, I2C_XFER_PEC, or I2C_XFER_ERROR with hi2c->ErrorCode set (HAL_I2C_ERROR_TIMEOUT
+// if BUSY was already set)
+static int i2c_ll_transfer(I2C_HandleTypeDef * hi2c, uint16_t address, const uint8_t * pwrite, uint16_t wr_count,
+		uint8_t * pread, uint16_t rd_count, int pec)
+{
+	I2C_TypeDef * i2c = hi2c->Instance;
+	uint32_t start_us = timestamp_us();
+	int ok = 0;
+	uint8_t residue = 0;
+
+	if(hi2c->State != HAL_I2C_STATE_READY || (i2c->SR2 & I2C_SR2_BUSY)) {
+		hi2c->ErrorCode = HAL_I2C_ERROR_TIMEOUT; // the bus (or handle) never came free - nothing was sent
+		return I2C_XFER_ERROR;
+	}
+	hi2c->State = HAL_I2C_STATE_BUSY;
+	hi2c->ErrorCode = HAL_I2C_ERROR_NONE;
+	i2c->CR1 &= ~(I2C_CR1_POS | I2C_CR1_ENPEC); // clearing ENPEC resets the PEC calculator
+	if(pec) i2c->CR1 |= I2C_CR1_ENPEC;
+
+	if(wr_count) {
+		if(!i2c_ll_address(hi2c, (uint8_t)(address << 1))) goto stop;
+		(void)i2c->SR2; // clear ADDR
+		for(uint16_t i=0;i<wr_count;i++) {
+			if(!i2c_ll_wait(hi2c, I2C_SR1_TXE)) goto stop;
+			i2c->DR = pwrite[i];
+		}
+		if(!i2c_ll_wait(hi2c, I2C_SR1_BTF)) goto stop; // last byte acknowledged
+		if(pec && !rd_count) {
+			i2c->DR = (uint8_t)(i2c->SR2 >> 8); // PEC of the address and data bytes
+			if(!i2c_ll_wait(hi2c, I2C_SR1_BTF)) goto stop;
+		}
+	}
+	if(rd_count) {
+		i2c->CR1 |= I2C_CR1_ACK;
+		if(rd_count == 2) i2c->CR1 |= I2C_CR1_POS;
+		if(!i2c_ll_address(hi2c, (uint8_t)(address << 1) | 1)) goto stop;
+		ok = i2c_ll_receive(hi2c, pread, rd_count);
+		goto done; // STOP already set
+	}
+	ok = 1;
+
+stop:
+	i2c->CR1 |= I2C_CR1_STOP;
+done:
+	if(pec) {
+		if(rd_count) residue = (uint8_t)(i2c->SR2 >> 8);
+		i2c->CR1 &= ~I2C_CR1_ENPEC;
+	}
+	__HAL_I2C_CLEAR_FLAG(hi2c, I2C_FLAG_AF);
+	__HAL_I2C_CLEAR_FLAG(hi2c, I2C_FLAG_BERR);
+	__HAL_I2C_CLEAR_FLAG(hi2c, I2C_FLAG_ARLO);
+	// Wait for the STOP to complete (hardware clears the STOP bit)
+	uint32_t start = timestamp_cycles();
+	while((i2c->CR1 & I2C_CR1_STOP) && timestamp_cycles() - start <= (SystemCoreClock / 1000000) * I2C_LL_TIMEOUT_US) ;
+	i2c->CR1 &= ~(I2C_CR1_POS | I2C_CR1_ACK);
+	hi2c->State = HAL_I2C_STATE_READY;
+
+	int8_t status = !ok? I2C_XFER_ERROR : residue? I2C_XFER_PEC : I2C_XFER_DONE;
+	i2c_trace_record(start_us, address, hi2c->Instance == I2C2? I2C_TRACE_BUS2 : 0, pwrite, wr_count, pread, rd_count,
+			status, hi2c->ErrorCode);
+	i2c_stats_record(hi2c->Instance == I2C2, address, wr_count, ok? rd_count : 0, ok? I2C_STATS_OK :
+			(hi2c->ErrorCode & HAL_I2C_ERROR_AF)? I2C_STATS_NACK :
+			(hi2c->ErrorCode & HAL_I2C_ERROR_TIMEOUT)? I2C_STATS_TIMEOUT : I2C_STATS_BUS_ERROR,
+			timestamp_us() - start_us);
+	return status;
+}
+
+// Polled write, repeated START, read - either span may be empty (not both)
+// Return I2C_XFER_DONE (0) for success, else I2C_XFER_ERROR with hi2c->ErrorCode set
+// (HAL_I2C_ERROR_AF for a NACK, HAL_I2C_ERROR_TIMEOUT if the bus was busy or a flag never arrived)
+int i2c_ll_write_read(I2C_HandleTypeDef * hi2c, uint16_t address, const uint8_t * pwrite, uint16_t wr_count,
+		uint8_t * pread, uint16_t rd_count)
+{
+	return i2c_ll_transfer(hi2c, address, pwrite, wr_count, pread, rd_count, 0);
+}
+
+// As i2c_ll_write_read(), with SMBus packet error checking by the peripheral's PEC calculator
+// A PEC byte follows the write span of a write-only transaction, or the read span - pread must have
+// room for rd_count + 1 bytes, the last receiving the device's PEC.
+// Return I2C_XFER_DONE, I2C_XFER_PEC if the device's PEC did not match, or I2C_XFER_ERROR
+int i2c_ll_write_read_pec(I2C_HandleTypeDef * hi2c, uint16_t address, const uint8_t * pwrite, uint16_t wr_count,
+		uint8_t * pread, uint16_t rd_count)
+{
+	return i2c_ll_transfer(hi2c, address, pwrite, wr_count, pread, rd_count? rd_count + 1 : 0, 1);
+}
+
+// Compare register reads through the HAL (polled HAL_I2C_Mem_Read(), and the interrupt driven engine)
+// against the register level path, on I2C1.  CPU cycles are per transaction; for the polled paths
+// the CPU is occupied throughout.  Bus time is the ideal time on the wire at the current SCL speed:
+// 9 clocks per byte (START, address, register, repeated START, address, data), plus START / STOP.
+// Expect: "i2cbench <i2caddress> <i2cregister> <count 1-3>"
+int cl_i2c_ll_bench(void)
+{
+	uint16_t i2c_address = strtol(argv[1],NULL,0); // allow user to use decimal or hex for address
+	uint8_t i2c_register = strtol(argv[2],NULL,0); // allow user to use decimal or hex for register
+	uint16_t count = argc > 3? strtol(argv[3],NULL,0) : 1;
+	int rc = cl_i2c_validate_address(i2c_address);
+	if(rc) return rc;
+	if(count < 1 || count > 3) {
+		printf("Expect count 1 to 3\n");
+		return -1;
+	}
+
+	const int loops = 32;
+	uint8_t data[3][3];
+	uint32_t cycles[3];
+	static const char * const name[3] = {"HAL polled", "HAL interrupt", "register level"};
+	for(int path=0;path<3 && !rc;path++) {
+		// The polled paths hold the bus, the interrupt driven path queues behind anything in progress
+		if(path != 1 && i2c_bus_lock(&i2c_bus1, I2C_LOCK_TIMEOUT_MS)) {
+			printf("I2C1 busy\n");
+			return -1;
+		}
+		uint32_t start = timestamp_cycles();
+		for(int i=0;i<loops && !rc;i++) {
+			if(path == 0)
+				rc = HAL_I2C_Mem_Read(&hi2c1, i2c_address<<1, i2c_register, I2C_MEMADD_SIZE_8BIT, data[0], count, i2c_timeout_ms(&i2c_bus1, i2c_address, 1 + count));
+			else if(path == 1) {
+				I2C_XFER xfer;
+				i2c_xfer_init(&xfer, i2c_address, &i2c_register, 1, data[1], count);
+				rc = i2c_transfer(&xfer, i2c_timeout_ms(&i2c_bus1, i2c_address, 1 + count));
+			}
+			else
+				rc = i2c_ll_write_read(&hi2c1, i2c_address, &i2c_register, 1, data[2], count);
+		}
+		cycles[path] = (timestamp_cycles() - start) / loops;
+		if(path != 1) i2c_bus_unlock(&i2c_bus1);
+		if(rc) printf("%s: error %d (0x%02lX)\n",name[path],rc,hi2c1.ErrorCode);
+	}
+	if(rc) return rc;
+
+	uint32_t mhz = SystemCoreClock / 1000000;
+	uint32_t bus_ns = (uint32_t)((9UL * (3 + count) + 3) * 1000000000ULL / hi2c1.Init.ClockSpeed);
+	printf("%u byte register read at %lu Hz, bus time %lu.%02luus\n",count,hi2c1.Init.ClockSpeed,bus_ns/1000,(bus_ns%1000)/10);
+	for(int path=0;path<3;path++) {
+		printf("%-15s %6lu cycles %5luus",name[path],cycles[path],cycles[path]/mhz);
+		for(int i=0;i<count;i++) printf(" %02X",data[path][i]);
+		printf("\n");
+	}
+	return 0;
+}
+
+#endif // HAL_I2C_MODULE_ENABLED
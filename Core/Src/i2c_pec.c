@@ -0,0 +1,204 @@
+// File: i2c_pec.c
+//
+// SMBus packet error checking: a CRC-8 (polynomial 0x07, initial value 0) over every byte of a
+// transaction - address bytes included - sent as one extra byte after the last byte written, or
+// returned by the device after the last byte read.
+//
+// Software: a 256 entry table, indexed by (crc ^ byte), replaces the eight shift / XOR steps per byte
+// of the bitwise form.  Hardware: the F103's I2C peripheral has its own PEC calculator (CR1 ENPEC),
+// which processes each byte as it crosses the bus, see i2c_ll_write_read_pec().
+//
+// i2c_write_read_pec() (i2c_async.c) is the transaction: the peripheral checks it when the bus is free
+// (I2C_PEC_HARDWARE, "i2cpec hw"), otherwise it joins the queue and the table checks it.  Either way
+// the outcome is counted here, and mismatches against the device in i2cstats.  With "i2cpec on", the
+// generic i2c commands (cl_i2c_write_read()) use it, reading at most I2C_PEC_DATA_MAX bytes; device
+// drivers never do.  "i2cpec bench" measures the cost per byte.
+
+#include <stdio.h>
+#include <stdlib.h> // strtol()
+#include <string.h> // strcmp()
+#include "main.h"   // HAL functions and defines
+#include "i2c_pec.h"
+#include "i2c_async.h"
+#include "i2c_stats.h"
+#include "cl_i2c.h"
+#include "timestamp.h"
+#include "command_line.h"
+
+#ifdef HAL_I2C_MODULE_ENABLED
+
+/* To implement the expected functionality, the following lines would be added to
+   command_line.c, in the cmd_table[]:
+
+#ifdef HAL_I2C_MODULE_ENABLED
+	{"i2cpec",    "i2cpec <on|off|hw|sw|reset|bench addr reg count>", 1, cl_i2c_pec},
+#endif // HAL_I2C_MODULE_ENABLED
+
+*/
+
+// CRC-8 of each byte value, polynomial I2C_PEC_POLY
+static const uint8_t i2c_pec_table[256] = {
+	0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D,
+	0x70, 0x77, 0x7E, 0x79, 0x6C, 0x6B, 0x62, 0x65, 0x48, 0x4F, 0x46, 0x41, 0x54, 0x53, 0x5A, 0x5D,
+	0xE0, 0xE7, 0xEE, 0xE9, 0xFC, 0xFB, 0xF2, 0xF5, 0xD8, 0xDF, 0xD6, 0xD1, 0xC4, 0xC3, 0xCA, 0xCD,
+	0x90, 0x97, 0x9E, 0x99, 0x8C, 0x8B, 0x82, 0x85, 0xA8, 0xAF, 0xA6, 0xA1, 0xB4, 0xB3, 0xBA, 0xBD,
+	0xC7, 0xC0, 0xC9, 0xCE, 0xDB, 0xDC, 0xD5, 0xD2, 0xFF, 0xF8, 0xF1, 0xF6, 0xE3, 0xE4, 0xED, 0xEA,
+	0xB7, 0xB0, 0xB9, 0xBE, 0xAB, 0xAC, 0xA5, 0xA2, 0x8F, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9D, 0x9A,
+	0x27, 0x20, 0x29, 0x2E, 0x3B, 0x3C, 0x35, 0x32, 0x1F, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0D, 0x0A,
+	0x57, 0x50, 0x59, 0x5E, 0x4B, 0x4C, 0x45, 0x42, 0x6F, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7D, 0x7A,
+	0x89, 0x8E, 0x87, 0x80, 0x95, 0x92, 0x9B, 0x9C, 0xB1, 0xB6, 0xBF, 0xB8, 0xAD, 0xAA, 0xA3, 0xA4,
+	0xF9, 0xFE, 0xF7, 0xF0, 0xE5, 0xE2, 0xEB, 0xEC, 0xC1, 0xC6, 0xCF, 0xC8, 0xDD, 0xDA, 0xD3, 0xD4,
+	0x69, 0x6E, 0x67, 0x60, 0x75, 0x72, 0x7B, 0x7C, 0x51, 0x56, 0x5F, 0x58, 0x4D, 0x4A, 0x43, 0x44,
+	0x19, 0x1E, 0x17, 0x10, 0x05, 0x02, 0x0B, 0x0C, 0x21, 0x26, 0x2F, 0x28, 0x3D, 0x3A, 0x33, 0x34,
+	0x4E, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5C, 0x5B, 0x76, 0x71, 0x78, 0x7F, 0x6A, 0x6D, 0x64, 0x63,
+	0x3E, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2C, 0x2B, 0x06, 0x01, 0x08, 0x0F, 0x1A, 0x1D, 0x14, 0x13,
+	0xAE, 0xA9, 0xA0, 0xA7, 0xB2, 0xB5, 0xBC, 0xBB, 0x96, 0x91, 0x98, 0x9F, 0x8A, 0x8D, 0x84, 0x83,
+	0xDE, 0xD9, 0xD0, 0xD7, 0xC2, 0xC5, 0xCC, 0xCB, 0xE6, 0xE1, 0xE8, 0xEF, 0xFA, 0xFD, 0xF4, 0xF3,
+};
+
+I2C_PEC_STATS i2c_pec_stats;
+uint8_t i2c_pec_hardware = I2C_PEC_HARDWARE; // peripheral PEC calculator when the bus is free
+uint8_t i2c_pec_commands;                    // cl_i2c_write_read() uses PEC
+
+// Continue a CRC-8 over count more bytes (start with crc 0)
+uint8_t i2c_pec_crc8(uint8_t crc, const uint8_t * data, uint16_t count)
+{
+	while(count--)
+		crc = i2c_pec_table[crc ^ *data++];
+	return crc;
+}
+
+// Bitwise form, for comparison (see "i2cpec bench")
+static uint8_t i2c_pec_crc8_bitwise(uint8_t crc, const uint8_t * data, uint16_t count)
+{
+	while(count--) {
+		crc ^= *data++;
+		for(int i=0;i<8;i++)
+			crc = crc & 0x80? (uint8_t)(crc << 1) ^ I2C_PEC_POLY : (uint8_t)(crc << 1);
+	}
+	return crc;
+}
+
+// PEC of a transaction: address byte (write) and the written bytes, then address byte (read) and the
+// bytes read.  Either span may be empty.
+uint8_t i2c_pec_message(uint16_t address, const uint8_t * pwrite, uint16_t wr_count, const uint8_t * pread, uint16_t rd_count)
+{
+	uint8_t crc = 0, address_byte;
+	if(wr_count) {
+		address_byte = (uint8_t)(address << 1);
+		crc = i2c_pec_crc8(crc, &address_byte, 1);
+		crc = i2c_pec_crc8(crc, pwrite, wr_count);
+	}
+	if(rd_count) {
+		address_byte = (uint8_t)(address << 1) | 1;
+		crc = i2c_pec_crc8(crc, &address_byte, 1);
+		crc = i2c_pec_crc8(crc, pread, rd_count);
+	}
+	return crc;
+}
+
+// Count a checked transaction on a bus (0 for I2C1, 1 for I2C2) - I2C_XFER_PEC counts as a mismatch
+// against the device as well
+void i2c_pec_record(uint8_t bus, uint16_t address, int hardware, int status)
+{
+	if(status != I2C_XFER_DONE && status != I2C_XFER_PEC) return; // never got as far as the PEC
+	if(hardware) i2c_pec_stats.hardware++; else i2c_pec_stats.software++;
+	if(status == I2C_XFER_PEC) {
+		i2c_pec_stats.mismatches++;
+		i2c_stats_pec_mismatch(bus, address);
+	}
+}
+
+// CRC-8 cost per byte, software forms, CPU cycles to one decimal place
+static void i2c_pec_bench_cpu(void)
+{
+	uint8_t data[256];
+	for(unsigned i=0;i<sizeof(data);i++) data[i] = (uint8_t)(i * 37 + 11);
+	const int loops = 4;
+	uint8_t crc[2] = {0, 0};
+	uint32_t cycles[2];
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq(); // CPU time only
+	uint32_t start = timestamp_cycles();
+	for(int i=0;i<loops;i++) crc[0] = i2c_pec_crc8_bitwise(crc[0], data, sizeof(data));
+	cycles[0] = timestamp_cycles() - start;
+	start = timestamp_cycles();
+	for(int i=0;i<loops;i++) crc[1] = i2c_pec_crc8(crc[1], data, sizeof(data));
+	cycles[1] = timestamp_cycles() - start;
+	__set_PRIMASK(primask);
+
+	uint32_t bytes = loops * sizeof(data);
+	printf("CRC-8 over %lu bytes: bitwise %lu.%lu cycles/byte, table %lu.%lu cycles/byte%s\n",bytes,
+			cycles[0] * 10 / bytes / 10,cycles[0] * 10 / bytes % 10,cycles[1] * 10 / bytes / 10,cycles[1] * 10 / bytes % 10,
+			crc[0] == crc[1]? "" : " - MISMATCH");
+	printf("Peripheral PEC calculator: no CPU time per byte, calculated as bytes cross the bus\n");
+}
+
+// Time register reads with PEC, checked by the peripheral and by table
+static int i2c_pec_bench_bus(uint16_t i2c_address, uint8_t i2c_register, uint16_t count)
+{
+	uint8_t data[I2C_PEC_DATA_MAX];
+	const int loops = 16;
+	uint8_t saved = i2c_pec_hardware;
+	for(int hw=I2C_PEC_HARDWARE;hw>=0;hw--) {
+		i2c_pec_hardware = hw;
+		uint32_t mismatches = i2c_pec_stats.mismatches;
+		int rc = 0;
+		uint32_t start = timestamp_us();
+		for(int i=0;i<loops && (rc == I2C_XFER_DONE || rc == I2C_XFER_PEC);i++)
+			rc = i2c_write_read_pec(cl_i2c_bus_selected, i2c_address, &i2c_register, 1, data, count);
+		uint32_t elapsed = timestamp_us() - start;
+		if(rc != I2C_XFER_DONE && rc != I2C_XFER_PEC) {
+			i2c_pec_hardware = saved;
+			printf("i2c read error %d\n",rc);
+			return rc;
+		}
+		printf("%u byte register read + PEC, %s: %luus, %lu of %u mismatched\n",count,hw? "peripheral":"table    ",
+				elapsed / loops,i2c_pec_stats.mismatches - mismatches,loops);
+	}
+	i2c_pec_hardware = saved;
+	return 0;
+}
+
+// Display PEC statistics, select how the i2c commands and the checks run, or measure the cost
+// Expect: "i2cpec"                       statistics
+//         "i2cpec <on|off>"              i2c commands use PEC
+//         "i2cpec <hw|sw>"               peripheral PEC calculator when the bus is free, or table only
+//         "i2cpec reset"
+//         "i2cpec bench <i2caddress> <register> <count>" CPU cost per byte, then timed reads (see i2cbus)
+int cl_i2c_pec(void)
+{
+	if(argc > 1 && !strcmp(argv[1],"bench")) {
+		i2c_pec_bench_cpu();
+		if(argc < 4) return 0;
+		uint16_t i2c_address = strtol(argv[2],NULL,0); // allow user to use decimal or hex for address
+		uint8_t i2c_register = strtol(argv[3],NULL,0); // allow user to use decimal or hex for register
+		uint16_t count = argc > 4? strtol(argv[4],NULL,0) : 2;
+		int rc = cl_i2c_validate_address(i2c_address);
+		if(rc) return rc;
+		if(!count || count > I2C_PEC_DATA_MAX) {
+			printf("Expect count 1 to %u\n",I2C_PEC_DATA_MAX);
+			return -1;
+		}
+		return i2c_pec_bench_bus(i2c_address, i2c_register, count);
+	}
+	if(argc > 1) {
+		if(!strcmp(argv[1],"on")) i2c_pec_commands = 1;
+		else if(!strcmp(argv[1],"off")) i2c_pec_commands = 0;
+		else if(!strcmp(argv[1],"hw") && I2C_PEC_HARDWARE) i2c_pec_hardware = 1;
+		else if(!strcmp(argv[1],"sw")) i2c_pec_hardware = 0;
+		else if(!strcmp(argv[1],"reset")) i2c_pec_stats = (I2C_PEC_STATS){0};
+		else {
+			printf("Expect: i2cpec <on|off|hw|sw|reset|bench addr reg count>\n");
+			return -1;
+		}
+	}
+	printf("i2c commands: PEC %s, checked by %s\n",i2c_pec_commands? "on":"off",
+			i2c_pec_hardware? "the peripheral when the bus is free, else table":"table");
+	printf("Checked: %lu peripheral, %lu table, %lu mismatched\n",i2c_pec_stats.hardware,
+			i2c_pec_stats.software,i2c_pec_stats.mismatches);
+	return 0;
+}
+
+#endif // HAL_I2C_MODULE_ENABLED
@@ -0,0 +1,148 @@
+// File: i2c_recover.c
+//
+// I2C bus lock-up detection and recovery, for either bus (I2C1, I2C2).
+//
+// A glitch (or a reset part way through a transaction) can leave a slave holding SDA low, waiting
+// for clocks to finish a byte, or leave the F103's I2C peripheral with BUSY set (see the STM32F10xx
+// errata, "I2C analog filter may provide wrong value, locking BUSY flag").  Either way every later
+// transaction fails until reset.  Recovery:
+//  1) Release the peripheral (HAL_I2C_DeInit), and drive the bus's SCL / SDA pins as open-drain GPIO
+//  2) Clock SCL up to 9 times, until the slave releases SDA
+//  3) Generate a STOP by hand: SDA low, SCL high, SDA high
+//  4) Software reset the peripheral (CR1 SWRST), clearing a stuck BUSY flag
+//  5) Re-run the bus's initialization (MX_I2C1_Init(), i2c2_init()), restoring the alternate function
+//     pins and configuration
+// The I2C engine (i2c_async.c) calls i2c_bus_recover() after a timeout or error leaves the bus
+// stuck, and checks for a stuck BUSY flag before starting work on an idle bus.  Each recovery's
+// reason and duration are recorded, bounding the worst case added latency.
+
+#include <stdio.h>
+#include <stdlib.h> // atoi()
+#include "main.h"   // HAL functions and defines
+#include "i2c_recover.h"
+#include "i2c_async.h"
+#include "timestamp.h"
+#include "command_line.h"
+
+#ifdef HAL_I2C_MODULE_ENABLED
+
+/* To implement the expected functionality, the following lines would be added to
+   command_line.c, in the cmd_table[]:
+
+#ifdef HAL_I2C_MODULE_ENABLED
+	{"i2crecover","i2c bus recovery statistics <force> <bus>",    1, cl_i2c_recover},
+#endif // HAL_I2C_MODULE_ENABLED
+
+*/
+
+static I2C_RECOVER_STATS i2c_recover_stats[I2C_BUS_COUNT];
+
+// Busy wait, micro-seconds (DWT cycle counter)
+static void i2c_recover_delay_us(uint32_t us)
+{
+	uint32_t start = timestamp_cycles();
+	uint32_t cycles = us * (SystemCoreClock / 1000000);
+	while(timestamp_cycles() - start < cycles) ;
+}
+
+// Return non-zero if the bus reports BUSY with no transaction in progress, for longer than
+// I2C_STUCK_US (a STOP just generated may take a few micro-seconds to clear BUSY)
+int i2c_bus_stuck(I2C_BUS * bus)
+{
+	uint32_t start = timestamp_cycles();
+	uint32_t limit = I2C_STUCK_US * (SystemCoreClock / 1000000);
+	while(bus->hi2c->Instance->SR2 & I2C_SR2_BUSY) {
+		if(timestamp_cycles() - start > limit) return 1;
+	}
+	return 0;
+}
+
+// Free the bus and reinitialize its peripheral - thread context, with the bus held (i2c_bus_lock())
+// Return 0 if SDA and SCL are both released afterwards
+int i2c_bus_recover(I2C_BUS * bus, uint8_t reason)
+{
+	uint32_t start = timestamp_us();
+	GPIO_InitTypeDef GPIO_InitStruct = {0};
+	I2C_RECOVER_STATS * st = &i2c_recover_stats[bus == &i2c_bus2];
+
+	// 1) Peripheral off, pins as open-drain outputs, released (high)
+	HAL_I2C_DeInit(bus->hi2c);
+	HAL_GPIO_WritePin(bus->port, bus->scl_pin | bus->sda_pin, GPIO_PIN_SET);
+	GPIO_InitStruct.Pin = bus->scl_pin | bus->sda_pin;
+	GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_OD;
+	GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+	HAL_GPIO_Init(bus->port, &GPIO_InitStruct);
+	i2c_recover_delay_us(I2C_RECOVER_HALF_US);
+
+	// 2) Clock out the byte a slave may be in the middle of sending
+	if(HAL_GPIO_ReadPin(bus->port, bus->sda_pin) == GPIO_PIN_RESET) {
+		st->sda_stuck++;
+		for(int i=0;i<I2C_RECOVER_CLOCKS && HAL_GPIO_ReadPin(bus->port, bus->sda_pin) == GPIO_PIN_RESET;i++) {
+			HAL_GPIO_WritePin(bus->port, bus->scl_pin, GPIO_PIN_RESET);
+			i2c_recover_delay_us(I2C_RECOVER_HALF_US);
+			HAL_GPIO_WritePin(bus->port, bus->scl_pin, GPIO_PIN_SET);
+			i2c_recover_delay_us(I2C_RECOVER_HALF_US);
+		}
+	}
+
+	// 3) STOP: SDA rises while SCL is high
+	HAL_GPIO_WritePin(bus->port, bus->scl_pin, GPIO_PIN_RESET);
+	i2c_recover_delay_us(I2C_RECOVER_HALF_US);
+	HAL_GPIO_WritePin(bus->port, bus->sda_pin, GPIO_PIN_RESET);
+	i2c_recover_delay_us(I2C_RECOVER_HALF_US);
+	HAL_GPIO_WritePin(bus->port, bus->scl_pin, GPIO_PIN_SET);
+	i2c_recover_delay_us(I2C_RECOVER_HALF_US);
+	HAL_GPIO_WritePin(bus->port, bus->sda_pin, GPIO_PIN_SET);
+	i2c_recover_delay_us(I2C_RECOVER_HALF_US);
+	int released = HAL_GPIO_ReadPin(bus->port, bus->sda_pin) == GPIO_PIN_SET &&
+			HAL_GPIO_ReadPin(bus->port, bus->scl_pin) == GPIO_PIN_SET;
+
+	// 4) Software reset - clears BUSY and all internal state (HAL_I2C_DeInit() stopped the I2C1 clock)
+	if(bus->hi2c->Instance == I2C1) __HAL_RCC_I2C1_CLK_ENABLE(); else __HAL_RCC_I2C2_CLK_ENABLE();
+	bus->hi2c->Instance->CR1 |= I2C_CR1_SWRST;
+	bus->hi2c->Instance->CR1 &= ~I2C_CR1_SWRST;
+
+	// 5) Initialization - pins back to alternate function, speed back to the default
+	bus->init();
+
+	uint32_t elapsed = timestamp_us() - start;
+	if(reason < I2C_RECOVER_REASONS) st->count[reason]++;
+	if(!released) st->failed++;
+	st->last_us = elapsed;
+	if(elapsed > st->max_us) st->max_us = elapsed;
+	st->last_tick = HAL_GetTick();
+	return released? 0 : -1;
+}
+
+// Display recovery statistics for each bus, optionally forcing a recovery
+// Expect: "i2crecover", or "i2crecover force <bus - default 1>"
+int cl_i2c_recover(void)
+{
+	if(argc > 1 && argv[1][0] == 'f') {
+		int n = argc > 2? atoi(argv[2]) : 1;
+		if(n < 1 || n > I2C_BUS_COUNT) {
+			printf("Expect bus 1 to %u\n",I2C_BUS_COUNT);
+			return -1;
+		}
+		I2C_BUS * bus = i2c_buses[n-1];
+		if(i2c_bus_lock(bus, I2C_LOCK_TIMEOUT_MS)) {
+			printf("%s busy\n",bus->name);
+			return -1;
+		}
+		int rc = i2c_bus_recover(bus, I2C_RECOVER_MANUAL);
+		i2c_bus_unlock(bus);
+		printf("%s recovery %s, %luus\n",bus->name,rc? "failed - SDA or SCL still low":"complete",i2c_recover_stats[n-1].last_us);
+	}
+	for(int i=0;i<I2C_BUS_COUNT;i++) {
+		I2C_RECOVER_STATS * st = &i2c_recover_stats[i];
+		printf("%s recoveries: %lu manual, %lu busy, %lu timeout, %lu error\n",i2c_buses[i]->name,st->count[I2C_RECOVER_MANUAL],
+				st->count[I2C_RECOVER_BUSY],st->count[I2C_RECOVER_TIMEOUT],st->count[I2C_RECOVER_ERROR]);
+		printf("  SDA held low: %lu, failed: %lu\n",st->sda_stuck,st->failed);
+		printf("  Time to recover: last %luus, max %luus",st->last_us,st->max_us);
+		if(st->last_tick) printf(", %lums ago",HAL_GetTick() - st->last_tick);
+		printf("\n");
+	}
+	return 0;
+}
+
+#endif // HAL_I2C_MODULE_ENABLED
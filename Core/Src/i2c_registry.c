@@ -0,0 +1,110 @@
+// File: i2c_registry.c
+//
+// Cached I2C device presence.
+//
+// Each completed transaction (i2c_async.c) and probe reports what it learned about its device:
+// acknowledged, not acknowledged (NACK), or a bus error.  i2c_device_present() answers from that
+// record, only probing the bus when the record is stale, unknown, or the last transaction failed.
+// A device in regular use (the DS3231 answering time queries) is therefore never probed.
+
+#include <stdio.h>
+#include "main.h"   // HAL functions and defines
+#include "i2c_registry.h"
+#include "i2c_ll.h"
+#include "i2c_async.h"
+#include "command_line.h"
+
+#ifdef HAL_I2C_MODULE_ENABLED
+
+/* To implement the expected functionality, the following lines would be added to
+   command_line.c, in the cmd_table[]:
+
+#ifdef HAL_I2C_MODULE_ENABLED
+	{"i2cdev",    "i2c device registry <reset>",                  1, cl_i2c_registry},
+#endif // HAL_I2C_MODULE_ENABLED
+
+*/
+
+extern I2C_HandleTypeDef hi2c1;
+
+static I2C_DEVICE i2c_registry[I2C_REGISTRY_SIZE];
+static I2C_REGISTRY_STATS i2c_registry_stats;
+
+// Record what a transaction or probe learned about a device - safe from any context
+void i2c_registry_update(uint16_t address, uint8_t state)
+{
+	uint32_t now = HAL_GetTick();
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	// Find the device, else replace an unused or the least recently updated entry
+	I2C_DEVICE * d = &i2c_registry[0];
+	for(int i=0;i<I2C_REGISTRY_SIZE;i++) {
+		I2C_DEVICE * e = &i2c_registry[i];
+		if(e->address == address) { d = e; break; }
+		if(!d->address) continue; // keep the unused entry found
+		if(!e->address || (int32_t)(e->last_update - d->last_update) < 0) d = e;
+	}
+	if(d->address != address) {
+		d->address = address;
+		d->last_seen = 0;
+	}
+	d->state = state;
+	d->last_update = now;
+	if(state == I2C_DEVICE_PRESENT) {
+		d->last_seen = now;
+		i2c_registry_stats.learned_ack++;
+	}
+	else if(state == I2C_DEVICE_ABSENT)
+		i2c_registry_stats.learned_nack++;
+	else
+		i2c_registry_stats.learned_error++;
+
+	__set_PRIMASK(primask);
+}
+
+// Return non-zero if the device is present
+// Answered from the registry if the device was recently seen, else probe the bus
+int i2c_device_present(uint16_t address)
+{
+	for(int i=0;i<I2C_REGISTRY_SIZE;i++) {
+		I2C_DEVICE * d = &i2c_registry[i];
+		if(d->address != address) continue;
+		if(d->state == I2C_DEVICE_PRESENT && HAL_GetTick() - d->last_seen < I2C_REGISTRY_STALE_MS) {
+			i2c_registry_stats.hits++;
+			return 1;
+		}
+		break;
+	}
+
+	i2c_registry_stats.misses++;
+	int rc = i2c_bus_probe(&i2c_bus1, address);
+	i2c_registry_update(address, rc == I2C_LL_ACK? I2C_DEVICE_PRESENT : rc == I2C_LL_NACK? I2C_DEVICE_ABSENT : I2C_DEVICE_UNKNOWN);
+	return rc == I2C_LL_ACK;
+}
+
+// Display (and optionally reset) the device registry and its statistics
+// Expect: "i2cdev" or "i2cdev reset"
+int cl_i2c_registry(void)
+{
+	static const char * const state_text[] = {"unknown", "present", "absent"};
+	uint32_t now = HAL_GetTick();
+	for(int i=0;i<I2C_REGISTRY_SIZE;i++) {
+		I2C_DEVICE * d = &i2c_registry[i];
+		if(!d->address) continue;
+		printf("0x%02X: %-8s updated %lums ago",d->address,state_text[d->state],now - d->last_update);
+		if(d->last_seen) printf(", seen %lums ago",now - d->last_seen);
+		printf("\n");
+	}
+	printf("Presence checks: %lu hits, %lu misses (probed)\n",i2c_registry_stats.hits,i2c_registry_stats.misses);
+	printf("Learned: %lu ACK, %lu NACK, %lu bus errors\n",i2c_registry_stats.learned_ack,
+			i2c_registry_stats.learned_nack,i2c_registry_stats.learned_error);
+	if(argc > 1 && argv[1][0] == 'r') {
+		for(int i=0;i<I2C_REGISTRY_SIZE;i++) i2c_registry[i] = (I2C_DEVICE){0};
+		i2c_registry_stats = (I2C_REGISTRY_STATS){0};
+		printf("Registry reset\n");
+	}
+	return 0;
+}
+
+#endif // HAL_I2C_MODULE_ENABLED
@@ -0,0 +1,119 @@
+// File: i2c_stats.c
+//
+// Per device I2C statistics: transactions, bytes, failures, bus occupancy, and a log2 latency
+// histogram (micro-seconds, TIM2 - see timestamp.c).
+//
+// The I2C engine (i2c_async.c) and address probes (i2c_ll.c) report each transaction here.  Only a
+// handful of devices share a bus, so a few slots are allocated on first use rather than keeping
+// counters for all 128 addresses on both buses.  A slot belongs to a bus and an address - the same
+// address on I2C1 and I2C2 is two devices.  Devices beyond I2C_STATS_SLOTS are summed in an overflow slot.
+
+#include <stdio.h>
+#include "main.h"   // HAL functions and defines
+#include "i2c_stats.h"
+#include "command_line.h"
+
+#ifdef HAL_I2C_MODULE_ENABLED
+
+/* To implement the expected functionality, the following lines would be added to
+   command_line.c, in the cmd_table[]:
+
+#ifdef HAL_I2C_MODULE_ENABLED
+	{"i2cstats",  "i2c statistics per device <reset>",            1, cl_i2c_stats},
+#endif // HAL_I2C_MODULE_ENABLED
+
+*/
+
+#define I2C_STATS_OVERFLOW  0xFFFF
+
+static I2C_ADDRESS_STATS i2c_stats[I2C_STATS_SLOTS + 1]; // last slot is the overflow slot
+
+// Return a device's slot, allocating one on first use - interrupts masked
+static I2C_ADDRESS_STATS * i2c_stats_slot(uint8_t bus, uint16_t address)
+{
+	for(int i=0;i<I2C_STATS_SLOTS;i++) {
+		I2C_ADDRESS_STATS * st = &i2c_stats[i];
+		if(!st->used) {
+			st->used = 1;
+			st->bus = bus;
+			st->address = address;
+			return st;
+		}
+		if(st->address == address && st->bus == bus) return st;
+	}
+	i2c_stats[I2C_STATS_SLOTS].used = 1;
+	i2c_stats[I2C_STATS_SLOTS].address = I2C_STATS_OVERFLOW;
+	return &i2c_stats[I2C_STATS_SLOTS];
+}
+
+// Record one transaction on a bus (0 for I2C1, 1 for I2C2) - safe from any context
+void i2c_stats_record(uint8_t bus, uint16_t address, uint16_t wr_count, uint16_t rd_count, uint8_t outcome, uint32_t duration_us)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	I2C_ADDRESS_STATS * st = i2c_stats_slot(bus, address);
+	st->transactions++;
+	st->bytes_written += wr_count;
+	st->bytes_read += rd_count;
+	st->busy_us += duration_us;
+	if(outcome == I2C_STATS_NACK) st->nacks++;
+	else if(outcome == I2C_STATS_TIMEOUT) st->timeouts++;
+	else if(outcome == I2C_STATS_BUS_ERROR) st->bus_errors++;
+
+	// log2 bucket: position of the highest set bit
+	int bucket = duration_us? 31 - __CLZ(duration_us) : 0;
+	if(bucket >= I2C_STATS_BUCKETS) bucket = I2C_STATS_BUCKETS - 1;
+	if(st->histogram[bucket] != 0xFFFF) st->histogram[bucket]++;
+
+	__set_PRIMASK(primask);
+}
+
+// Record a PEC mismatch, for a transaction already recorded by i2c_stats_record() - safe from any context
+void i2c_stats_pec_mismatch(uint8_t bus, uint16_t address)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	i2c_stats_slot(bus, address)->pec_errors++;
+	__set_PRIMASK(primask);
+}
+
+// Display (and optionally reset) per device statistics
+// Expect: "i2cstats" or "i2cstats reset"
+int cl_i2c_stats(void)
+{
+	uint32_t total_busy = 0;
+	for(int i=0;i<=I2C_STATS_SLOTS;i++) total_busy += i2c_stats[i].busy_us;
+
+	printf("device     xfers  wr bytes  rd bytes  nack  tmo  err  pec   busy(us)  share\n");
+	for(int i=0;i<=I2C_STATS_SLOTS;i++) {
+		I2C_ADDRESS_STATS * st = &i2c_stats[i];
+		if(!st->used) continue;
+		if(st->address == I2C_STATS_OVERFLOW) printf("other     ");
+		else printf("I2C%u 0x%02X ",st->bus + 1,st->address);
+		printf("%6lu %9lu %9lu %5lu %4lu %4lu %4lu %10lu %5lu%%\n",st->transactions,st->bytes_written,st->bytes_read,
+				st->nacks,st->timeouts,st->bus_errors,st->pec_errors,st->busy_us,total_busy? (uint32_t)((uint64_t)st->busy_us*100/total_busy) : 0);
+	}
+
+	// Latency histograms, non-empty buckets only
+	for(int i=0;i<=I2C_STATS_SLOTS;i++) {
+		I2C_ADDRESS_STATS * st = &i2c_stats[i];
+		if(!st->used) continue;
+		if(st->address == I2C_STATS_OVERFLOW) printf("other latency:");
+		else printf("I2C%u 0x%02X latency:",st->bus + 1,st->address);
+		for(int b=0;b<I2C_STATS_BUCKETS;b++)
+			if(st->histogram[b]) printf(" <%luus:%u",2UL<<b,st->histogram[b]);
+		printf("\n");
+	}
+
+	if(argc > 1 && argv[1][0] == 'r') {
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		for(int i=0;i<=I2C_STATS_SLOTS;i++) i2c_stats[i] = (I2C_ADDRESS_STATS){0};
+		__set_PRIMASK(primask);
+		printf("Statistics reset\n");
+	}
+	return 0;
+}
+
+#endif // HAL_I2C_MODULE_ENABLED
@@ -0,0 +1,282 @@
+// File: i2c_target.c
+//
+// I2C target (slave) mode: I2C1 or I2C2 answers as an AT24C32 EEPROM or a DS3231 RTC, the device's
+// storage / register file held in RAM, for exercising other boards' I2C masters.
+//
+// Protocol, as the real parts: a write starts with the address pointer (two bytes, high first, for
+// the AT24C32; one for the DS3231), then data stored from the pointer onward.  A read returns data
+// from the pointer onward.  The pointer auto-increments, wrapping at the end of the memory - and, for
+// AT24C32 writes, within the 32 byte page.  There is no write cycle time; the emulated EEPROM always
+// acknowledges.
+//
+// The peripheral runs with clock stretching disabled (CR1 NOSTRETCH), so a slow interrupt can never
+// hold up the master's SCL.  In exchange, the data register must be loaded before the master clocks
+// each byte.  The next byte to read is therefore always staged in DR, one byte ahead of the bus:
+// when a transaction ends, and after every byte received (the pointer may have just been written,
+// ahead of a repeated START read).  When a byte moves to the shift register (TXE), the one after it
+// is loaded, giving the interrupt a whole byte time (22.5us at 400KHz) to respond.  A byte missed
+// anyway - received before the previous one was read, or sent twice because DR was not reloaded - sets
+// OVR, and is counted as an overrun.  The longest event interrupt is recorded against that budget.
+// For the budget to hold, the target bus's interrupts pre-empt every other interrupt while it is
+// active (IRQ_PRIORITY_TARGET, main.h); code that masks interrupts still delays them.
+//
+// The event and error interrupts are handled here, at register level, rather than through the HAL:
+// stm32f1xx_it.c offers each I2C interrupt to i2c_target_event() / i2c_target_error() first.  While
+// a bus is a target it is held with i2c_bus_lock() (i2c_async.c), so master transactions submitted
+// to it wait in its queue until the target stops.
+
+#include <stdio.h>
+#include <stdlib.h> // strtol()
+#include <string.h> // strcmp()
+#include "main.h"   // HAL functions and defines
+#include "i2c_target.h"
+#include "i2c_async.h"
+#include "at24c32.h"
+#include "cl_ds3231.h"
+#include "timestamp.h"
+#include "command_line.h"
+
+#ifdef HAL_I2C_MODULE_ENABLED
+
+/* To implement the expected functionality, the following lines would be added to
+   command_line.c, in the cmd_table[]:
+
+#ifdef HAL_I2C_MODULE_ENABLED
+	{"i2ctarget", "i2ctarget <at24c32|ds3231 <bus>|off|dump first count|reset>", 1, cl_i2c_target},
+#endif // HAL_I2C_MODULE_ENABLED
+
+*/
+
+typedef struct {
+	const char * name;
+	uint16_t address;            // 7-bit target address
+	uint8_t * mem;
+	uint16_t size;               // bytes, the pointer wraps to 0 at the end
+	uint8_t pointer_bytes;       // address pointer bytes at the start of a write, high byte first
+	uint8_t page;                // writes wrap within a page of this size (power of 2), 0 for none
+} I2C_TARGET_DEVICE;
+
+static uint8_t i2c_target_eeprom[AT24C32_BYTE_COUNT];
+static uint8_t i2c_target_rtc[I2C_TARGET_DS3231_REGS] = {
+	[0x0E] = 0x1C,               // control: power-on value
+};
+
+static const I2C_TARGET_DEVICE i2c_target_devices[] = {
+	[I2C_TARGET_AT24C32] = {"at24c32", I2C_ADDRESS_AT24C32, i2c_target_eeprom, sizeof(i2c_target_eeprom), 2, AT24C32_PAGE_WRITE_SIZE},
+	[I2C_TARGET_DS3231]  = {"ds3231",  I2C_ADDRESS_DS3231,  i2c_target_rtc,    sizeof(i2c_target_rtc),    1, 0},
+};
+#define I2C_TARGET_DEVICES  (sizeof(i2c_target_devices)/sizeof(i2c_target_devices[0]))
+
+I2C_TARGET_STATS i2c_target_stats;
+
+static struct {
+	I2C_BUS * volatile bus;      // bus answering as the target, NULL when stopped
+	const I2C_TARGET_DEVICE * dev; // device emulated, or most recently emulated
+	uint16_t pointer;            // next byte to read or write - the byte staged in DR
+	uint8_t pointer_count;       // pointer bytes received so far in the current write
+	uint8_t transmitting;        // addressed for a read
+} i2c_target = {NULL, &i2c_target_devices[I2C_TARGET_AT24C32]};
+
+// Load the byte at the pointer into DR, ready for a read
+static void i2c_target_stage(I2C_TypeDef * i2c)
+{
+	i2c->DR = i2c_target.dev->mem[i2c_target.pointer];
+}
+
+// Next pointer value for a read - wraps at the end of the memory
+static uint16_t i2c_target_next(uint16_t pointer)
+{
+	return ++pointer >= i2c_target.dev->size? 0 : pointer;
+}
+
+// Event interrupt (ADDR, RXNE, TXE, STOPF)
+// Return 0 if the bus is not a target - the caller passes the interrupt to the HAL
+int i2c_target_event(I2C_HandleTypeDef * hi2c)
+{
+	I2C_BUS * bus = i2c_target.bus;
+	if(!bus || bus->hi2c != hi2c) return 0;
+	uint32_t start = timestamp_cycles();
+	I2C_TypeDef * i2c = hi2c->Instance;
+	const I2C_TARGET_DEVICE * dev = i2c_target.dev;
+	uint32_t sr1 = i2c->SR1;
+
+	if(sr1 & I2C_SR1_ADDR) {
+		// Reading SR1, then SR2 clears ADDR.  For a read, the staged byte is already on its way.
+		i2c_target.transmitting = (i2c->SR2 & I2C_SR2_TRA) != 0;
+		i2c_target.pointer_count = 0;
+		i2c_target_stats.transactions++;
+		i2c->CR2 |= I2C_CR2_ITBUFEN; // RXNE / TXE interrupts for the data bytes
+		sr1 = i2c->SR1;
+	}
+	if(sr1 & I2C_SR1_RXNE) {
+		uint8_t c = (uint8_t)i2c->DR;
+		i2c_target_stats.rx_bytes++;
+		if(i2c_target.pointer_count < dev->pointer_bytes) {
+			uint16_t pointer = i2c_target.pointer_count++? (uint16_t)(i2c_target.pointer << 8) : 0;
+			i2c_target.pointer = (pointer | c) % dev->size;
+		}
+		else {
+			uint16_t p = i2c_target.pointer;
+			dev->mem[p] = c;
+			i2c_target.pointer = dev->page? (p & ~(dev->page - 1)) | ((p + 1) & (dev->page - 1)) : i2c_target_next(p);
+		}
+		i2c_target_stage(i2c); // a repeated START read may follow
+	}
+	else if((sr1 & I2C_SR1_TXE) && i2c_target.transmitting) {
+		// Staged byte moved to the shift register - stage the one after it
+		i2c_target_stats.tx_bytes++;
+		i2c_target.pointer = i2c_target_next(i2c_target.pointer);
+		i2c_target_stage(i2c);
+	}
+	if(sr1 & I2C_SR1_STOPF) {
+		i2c->CR1 |= I2C_CR1_PE; // reading SR1, then writing CR1 clears STOPF
+		i2c->CR2 &= ~I2C_CR2_ITBUFEN;
+		i2c_target.transmitting = 0;
+		i2c_target_stage(i2c);
+	}
+
+	uint32_t cycles = timestamp_cycles() - start;
+	if(cycles > i2c_target_stats.isr_max_cycles) i2c_target_stats.isr_max_cycles = cycles;
+	return 1;
+}
+
+// Error interrupt (AF, OVR, BERR)
+// Return 0 if the bus is not a target - the caller passes the interrupt to the HAL
+int i2c_target_error(I2C_HandleTypeDef * hi2c)
+{
+	I2C_BUS * bus = i2c_target.bus;
+	if(!bus || bus->hi2c != hi2c) return 0;
+	I2C_TypeDef * i2c = hi2c->Instance;
+	uint32_t sr1 = i2c->SR1;
+
+	if(sr1 & I2C_SR1_AF) {
+		// Master NACK, the end of a read.  The staged byte was not sent and stays staged - unless
+		// the last byte left DR before TXE was serviced.
+		if(i2c_target.transmitting && (sr1 & I2C_SR1_TXE)) {
+			i2c_target_stats.tx_bytes++;
+			i2c_target.pointer = i2c_target_next(i2c_target.pointer);
+		}
+		i2c_target.transmitting = 0;
+		i2c->CR2 &= ~I2C_CR2_ITBUFEN;
+		__HAL_I2C_CLEAR_FLAG(hi2c, I2C_FLAG_AF);
+		i2c_target_stage(i2c);
+	}
+	if(sr1 & I2C_SR1_OVR) {
+		i2c_target_stats.overruns++;
+		__HAL_I2C_CLEAR_FLAG(hi2c, I2C_FLAG_OVR);
+	}
+	if(sr1 & (I2C_SR1_BERR | I2C_SR1_ARLO)) {
+		i2c_target_stats.errors++;
+		__HAL_I2C_CLEAR_FLAG(hi2c, I2C_FLAG_BERR);
+		__HAL_I2C_CLEAR_FLAG(hi2c, I2C_FLAG_ARLO);
+	}
+	return 1;
+}
+
+// Set the NVIC pre-emption priority of a bus's event and error interrupts
+static void i2c_target_priority(I2C_BUS * bus, uint32_t priority)
+{
+	int i2c1 = bus->hi2c->Instance == I2C1;
+	HAL_NVIC_SetPriority(i2c1? I2C1_EV_IRQn : I2C2_EV_IRQn, priority, 0);
+	HAL_NVIC_SetPriority(i2c1? I2C1_ER_IRQn : I2C2_ER_IRQn, priority, 0);
+}
+
+// Answer as a device on a bus, until i2c_target_stop()
+// Return 0, or -1 if the device is unknown or the bus did not come free
+int i2c_target_start(I2C_BUS * bus, uint8_t device)
+{
+	if(device >= I2C_TARGET_DEVICES) return -1;
+	i2c_target_stop();
+	if(i2c_bus_lock(bus, I2C_LOCK_TIMEOUT_MS)) return -1; // master transactions wait until the target stops
+
+	I2C_TypeDef * i2c = bus->hi2c->Instance;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	i2c_target.dev = &i2c_target_devices[device];
+	i2c_target.pointer = 0;
+	i2c_target.transmitting = 0;
+	i2c->CR2 &= ~(I2C_CR2_ITEVTEN | I2C_CR2_ITBUFEN | I2C_CR2_ITERREN);
+	i2c->CR1 &= ~I2C_CR1_PE;
+	i2c->OAR1 = (1UL << 14) | (i2c_target.dev->address << 1); // 7-bit address, bit 14 kept at 1 (RM0008)
+	i2c->CR1 |= I2C_CR1_NOSTRETCH;
+	i2c->CR1 |= I2C_CR1_PE;
+	i2c->CR1 |= I2C_CR1_ACK; // ACK is cleared by hardware while PE=0
+	i2c_target_stage(i2c);
+	i2c_target.bus = bus;
+	i2c_target_priority(bus, IRQ_PRIORITY_TARGET);
+	i2c->CR2 |= I2C_CR2_ITEVTEN | I2C_CR2_ITERREN;
+	__set_PRIMASK(primask);
+	return 0;
+}
+
+// Return the bus to master mode
+void i2c_target_stop(void)
+{
+	I2C_BUS * bus = i2c_target.bus;
+	if(!bus) return;
+	I2C_TypeDef * i2c = bus->hi2c->Instance;
+	i2c->CR2 &= ~(I2C_CR2_ITEVTEN | I2C_CR2_ITBUFEN | I2C_CR2_ITERREN);
+	i2c_target.bus = NULL;
+	i2c_target_priority(bus, IRQ_PRIORITY_DEFAULT);
+	i2c->CR1 &= ~(I2C_CR1_ACK | I2C_CR1_NOSTRETCH);
+	bus->init(); // master configuration and own address, as at power up
+	i2c_bus_unlock(bus);
+}
+
+void hexdump_addr(const void* address, unsigned count, unsigned displayaddr); // hexdump.c
+
+// Emulate a device, stop, or display the emulated memory and statistics
+// Expect: "i2ctarget"                     status, statistics
+//         "i2ctarget <at24c32|ds3231> <bus>" answer as the device on I2C1 or I2C2 (default I2C2)
+//         "i2ctarget off"
+//         "i2ctarget dump <first> <count>" display the emulated memory
+//         "i2ctarget reset"               clear statistics
+int cl_i2c_target(void)
+{
+	if(argc > 1 && !strcmp(argv[1],"off")) {
+		i2c_target_stop();
+	}
+	else if(argc > 1 && !strcmp(argv[1],"reset")) {
+		i2c_target_stats = (I2C_TARGET_STATS){0};
+	}
+	else if(argc > 1 && !strcmp(argv[1],"dump")) {
+		const I2C_TARGET_DEVICE * dev = i2c_target.dev;
+		uint16_t first = argc > 2? strtol(argv[2],NULL,0) : 0;
+		uint16_t count = argc > 3? strtol(argv[3],NULL,0) : dev->size < 256? dev->size : 256;
+		if(first >= dev->size || !count || count > dev->size - first) {
+			printf("Expect first 0 to %u, %u bytes in all\n",dev->size - 1,dev->size);
+			return -1;
+		}
+		hexdump_addr(&dev->mem[first], count, first);
+		return 0;
+	}
+	else if(argc > 1) {
+		unsigned device = 0;
+		while(device < I2C_TARGET_DEVICES && strcmp(argv[1],i2c_target_devices[device].name)) device++;
+		int n = argc > 2? atoi(argv[2]) : I2C_TARGET_BUS_DEFAULT;
+		if(device >= I2C_TARGET_DEVICES || n < 1 || n > I2C_BUS_COUNT) {
+			printf("Expect: i2ctarget <at24c32|ds3231> <bus 1 to %u>\n",I2C_BUS_COUNT);
+			return -1;
+		}
+		if(i2c_target_start(i2c_buses[n-1], device)) {
+			printf("%s busy\n",i2c_buses[n-1]->name);
+			return -1;
+		}
+	}
+
+	I2C_BUS * bus = i2c_target.bus;
+	if(bus)
+		printf("%s: target at 0x%02X, emulating %s (%u bytes), pointer 0x%03X\n",bus->name,i2c_target.dev->address,
+				i2c_target.dev->name,i2c_target.dev->size,i2c_target.pointer);
+	else
+		printf("Target mode off\n");
+	uint32_t mhz = SystemCoreClock / 1000000;
+	printf("Transactions: %lu, bytes served: %lu, received: %lu\n",i2c_target_stats.transactions,
+			i2c_target_stats.tx_bytes,i2c_target_stats.rx_bytes);
+	printf("Overruns: %lu, bus errors: %lu\n",i2c_target_stats.overruns,i2c_target_stats.errors);
+	printf("Longest interrupt: %lu cycles (%luus), one byte at 400KHz: 22us\n",i2c_target_stats.isr_max_cycles,
+			i2c_target_stats.isr_max_cycles / mhz);
+	return 0;
+}
+
+#endif // HAL_I2C_MODULE_ENABLED
@@ -0,0 +1,118 @@
+// File: i2c_trace.c
+//
+// I2C transaction trace buffer.
+//
+// Each transaction completed by the I2C engine (i2c_async.c), and each address probe (i2c_ll.c), is
+// recorded in a fixed size ring of I2C_TRACE_ENTRY records, overwriting the oldest.  Recording is a
+// single structure fill with interrupts masked only while the slot index is claimed, so it is cheap
+// enough to leave on permanently.  The i2ctrace command displays, filters, clears, or exports the
+// ring.
+//
+// Export format ("i2ctrace export"): a header line, "I2CTRACE <version> <entry count> <entry size>",
+// followed by one line per entry, oldest first, holding the raw little-endian I2C_TRACE_ENTRY bytes
+// as hex.  A host script can unpack each line with the structure layout in i2c_trace.h.
+
+#include <stdio.h>
+#include <string.h> // memcpy()
+#include "main.h"   // HAL functions and defines
+#include "i2c_trace.h"
+#include "command_line.h"
+#include "timestamp.h"
+
+#ifdef HAL_I2C_MODULE_ENABLED
+
+/* To implement the expected functionality, the following lines would be added to
+   command_line.c, in the cmd_table[]:
+
+#ifdef HAL_I2C_MODULE_ENABLED
+	{"i2ctrace",  "i2ctrace <i2c address|clear|export>",          1, cl_i2c_trace},
+#endif // HAL_I2C_MODULE_ENABLED
+
+*/
+
+#define I2C_TRACE_VERSION  1
+
+static I2C_TRACE_ENTRY i2c_trace[I2C_TRACE_SIZE];
+static uint32_t i2c_trace_head; // free running count of entries recorded
+
+// Record one transaction - safe from any context
+void i2c_trace_record(uint32_t start_us, uint16_t address, uint8_t flags, const uint8_t * pwrite, uint16_t wr_count,
+		const uint8_t * pread, uint16_t rd_count, int8_t status, uint32_t error)
+{
+	uint32_t duration = timestamp_us() - start_us;
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	I2C_TRACE_ENTRY * e = &i2c_trace[i2c_trace_head++ & (I2C_TRACE_SIZE-1)];
+	__set_PRIMASK(primask);
+
+	e->timestamp = start_us;
+	e->duration = duration > 0xFFFF? 0xFFFF : (uint16_t)duration;
+	e->wr_count = wr_count;
+	e->rd_count = rd_count;
+	e->address = (uint8_t)address;
+	e->flags = flags;
+	e->status = status;
+	e->error = (uint8_t)error;
+	// Leading data bytes - the write span (register index, for example), else what was read
+	const uint8_t * src = wr_count? pwrite : (status == 0? pread : NULL);
+	uint16_t n = wr_count? wr_count : rd_count;
+	if(n > I2C_TRACE_DATA) n = I2C_TRACE_DATA;
+	if(!src) n = 0;
+	if(n) memcpy(e->data, src, n);
+	memset(&e->data[n], 0, I2C_TRACE_DATA - n);
+}
+
+// Display one entry
+static void i2c_trace_display(const I2C_TRACE_ENTRY * e)
+{
+	printf("%10lu %5u 0x%02X%s ",e->timestamp,e->duration,e->address,(e->flags & I2C_TRACE_BUS2)? "/2":"  ");
+	if(e->flags & I2C_TRACE_PROBE)
+		printf("probe        ");
+	else
+		printf("W%-4u R%-4u  ",e->wr_count,e->rd_count);
+	uint16_t n = e->wr_count? e->wr_count : e->rd_count;
+	for(int i=0;i<I2C_TRACE_DATA;i++) {
+		if(i < n && !(e->flags & I2C_TRACE_PROBE)) printf("%02X ",e->data[i]);
+		else printf("   ");
+	}
+	printf(" %d",e->status);
+	if(e->error) printf(" (0x%02X)",e->error);
+	printf("\n");
+}
+
+// Display, filter, clear, or export the trace
+// Expect: "i2ctrace", "i2ctrace <i2caddress>", "i2ctrace clear", "i2ctrace export"
+int cl_i2c_trace(void)
+{
+	uint32_t head = i2c_trace_head;
+	uint32_t count = head < I2C_TRACE_SIZE? head : I2C_TRACE_SIZE;
+	uint32_t first = head - count; // oldest entry
+
+	if(argc > 1 && argv[1][0] == 'c') {
+		i2c_trace_head = 0;
+		printf("Trace cleared\n");
+		return 0;
+	}
+	if(argc > 1 && argv[1][0] == 'e') {
+		printf("I2CTRACE %u %lu %u\n",I2C_TRACE_VERSION,count,(unsigned)sizeof(I2C_TRACE_ENTRY));
+		for(uint32_t i=first;i!=head;i++) {
+			const uint8_t * raw = (const uint8_t *)&i2c_trace[i & (I2C_TRACE_SIZE-1)];
+			for(unsigned b=0;b<sizeof(I2C_TRACE_ENTRY);b++) printf("%02X",raw[b]);
+			printf("\n");
+		}
+		return 0;
+	}
+
+	int filter = argc > 1? (int)strtol(argv[1],NULL,0) : -1;
+	printf("  time(us)   dur addr   length       data         status\n");
+	for(uint32_t i=first;i!=head;i++) {
+		const I2C_TRACE_ENTRY * e = &i2c_trace[i & (I2C_TRACE_SIZE-1)];
+		if(filter >= 0 && e->address != filter) continue;
+		i2c_trace_display(e);
+	}
+	printf("%lu recorded, %lu shown max\n",head,count);
+	return 0;
+}
+
+#endif // HAL_I2C_MODULE_ENABLED
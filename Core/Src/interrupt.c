@@ -11,6 +11,7 @@
 //  over-riden with one supplied by the user.
 
 #include "main.h" // HAL, LL, and push button defines
+#include "events.h"
 
 extern uint32_t interrupt_counter; // main.c
 
@@ -23,5 +24,6 @@ void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
 {
 	HAL_GPIO_TogglePin(LD2_GPIO_Port, LD2_Pin);
 	interrupt_counter++;
+	event_post(EVENT_BUTTON); // wake the main loop
 }
 
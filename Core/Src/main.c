@@ -23,6 +23,12 @@
 /* USER CODE BEGIN Includes */
 #include <stdio.h> // printf()
 #include "command_line.h"
+#include "serial.h"
+#include "events.h"
+#include "timestamp.h"
+#include "task.h"
+#include "sampler.h"
+#include "i2c_async.h"
 
 /* USER CODE END Includes */
 
@@ -51,6 +57,9 @@ TIM_HandleTypeDef htim2;
 UART_HandleTypeDef huart2;
 
 /* USER CODE BEGIN PV */
+I2C_HandleTypeDef hi2c2; // not in the .ioc file, see i2c2_init()
+DMA_HandleTypeDef hdma_usart2_rx;
+DMA_HandleTypeDef hdma_usart2_tx;
 
 /* USER CODE END PV */
 
@@ -66,52 +75,9 @@ static void MX_TIM2_Init(void);
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
-#define HAL_SMALL_WAIT  40
-// Define serial input and output functions using UART2
-int __io_putchar(int ch)
-{
-    HAL_UART_Transmit(&huart2, (uint8_t *)&ch, 1, HAL_SMALL_WAIT);
-    return 1;
-}
-
-// Read a character from the UART with small timeout
-// This function works well if called within a 50ms or shorter loop, but may lose characters if
-// data is received with any real speed.
-// Use DMA for receive data if trying to perform higher speed communication (anything faster than typing).
-// If HAL_UART_Receive() returns error, return EOF (-1), else return the character read
-int __io_getchar(void)
-{
-    uint8_t byte;
-    HAL_StatusTypeDef hal_status = HAL_UART_Receive(&huart2, &byte, sizeof(byte), HAL_SMALL_WAIT);
-    if(HAL_OK == hal_status)
-    {
-        return byte;
-    }
-    else
-        return EOF;
-}
+// Serial input and output, __io_getchar(), __io_putchar() and _write(), are DMA driven - see serial.c
 
-// 1) If write buffer and wr_count provided, begin sending bytes to the I2C device.
-// 2) If read buffer and rd_count provided, send restart condition followed by
-//      reading bytes from the device into buffer.
-#define I2C_TIMEOUT	50		// 50ms timeout
-HAL_StatusTypeDef i2c_write_read(uint16_t devAddress, uint8_t * pwrite, uint16_t wr_count, uint8_t * pread, uint16_t rd_count)
-{
-	HAL_StatusTypeDef rc=HAL_OK;
-	if(pwrite && wr_count) {
-		// If write pointer and count provided, begin by sending data
-		rc=HAL_I2C_Master_Transmit(&hi2c1, devAddress, pwrite, wr_count, I2C_TIMEOUT);
-	}
-	// Return now if error
-	if(rc!=HAL_OK) return rc;
-
-	if(pread && rd_count) {
-		// If read pointer and count provided, read data from device
-		rc=HAL_I2C_Master_Receive(&hi2c1, devAddress, pread, rd_count, I2C_TIMEOUT);
-	}
-
-	return rc;
-}
+// I2C write / repeated start / read transactions - see cl_i2c_write_read() in cl_i2c.c
 
 // Counter incremented each time blue push button is pressed
 uint32_t interrupt_counter = 0;
@@ -150,6 +116,7 @@ int main(void)
   MX_I2C1_Init();
   MX_TIM2_Init();
   /* USER CODE BEGIN 2 */
+  i2c2_init(); // second I2C bus
   //setvbuf(stdout, NULL, _IONBF, 0); // Disable STDOUT stream buffering - done in cl_setup()
   cl_setup(); // Initialize command line interface
 
@@ -161,17 +128,40 @@ int main(void)
   while (1)
   {   //HAL_GPIO_TogglePin(LD2_GPIO_Port, LD2_Pin);
       //printf("Hello World\n");
-      cl_loop(); // look for characters from serial port
+#if EVENT_LOOP_POLLED
+      // Original polled loop - adds up to 50ms latency to each keystroke and button press
+      uint32_t events = event_get() | EVENT_UART_RX | EVENT_BUTTON | EVENT_TASK;
+      HAL_Delay(50);
+#else
+      // Sleep until an interrupt posts an event
+      uint32_t events = event_wait();
+#endif
+
+      if(events & EVENT_BREAK)
+          task_cancel_foreground(); // Ctrl-C
+
+      // While a command's task runs, input waits in the receive buffer (task.c re-posts EVENT_UART_RX)
+      if((events & EVENT_UART_RX) && !task_foreground_busy()) {
+          cl_loop(); // process characters from serial port
+          // cl_loop() returns after each command - come back for any remaining input
+          if(ring_count(&serial_rx_ring)) event_post(EVENT_UART_RX);
+      }
+
+      // Recover an I2C bus held after a timeout or bus fault, see i2c_async.c
+      if(events & EVENT_I2C)
+          i2c_service();
+
+      // Resume long running commands, see task.c
+      if(events & (EVENT_TASK | EVENT_TIMER))
+          task_run();
 
       // If user pressed the blue button, it increments a counter each time.
       // If the counter value has changed, display count value
-      // After 55 "rapid fire" button presses, only once did two interrupts fire during 50ms delay
-      if(interrupt_counter != last_counter_peak) {
+      if((events & EVENT_BUTTON) && interrupt_counter != last_counter_peak) {
     	  printf("IntCntr: %lu\n",interrupt_counter);
     	  last_counter_peak = interrupt_counter;
       }
 
-      HAL_Delay(50);
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
@@ -292,7 +282,7 @@ static void MX_TIM2_Init(void)
     Error_Handler();
   }
   /* USER CODE BEGIN TIM2_Init 2 */
-  HAL_TIM_Base_Start(&htim2);
+  timestamp_init(); // start TIM2, counting roll-overs for 32-bit time stamps
 
   /* USER CODE END TIM2_Init 2 */
 
@@ -326,6 +316,7 @@ static void MX_USART2_UART_Init(void)
     Error_Handler();
   }
   /* USER CODE BEGIN USART2_Init 2 */
+  serial_init(); // DMA driven transmit and receive
 
   /* USER CODE END USART2_Init 2 */
 
@@ -365,7 +356,7 @@ static void MX_GPIO_Init(void)
   HAL_GPIO_Init(LD2_GPIO_Port, &GPIO_InitStruct);
 
   /* EXTI interrupt init*/
-  HAL_NVIC_SetPriority(EXTI15_10_IRQn, 0, 0);
+  HAL_NVIC_SetPriority(EXTI15_10_IRQn, 1, 0);
   HAL_NVIC_EnableIRQ(EXTI15_10_IRQn);
 
 /* USER CODE BEGIN MX_GPIO_Init_2 */
@@ -373,6 +364,45 @@ static void MX_GPIO_Init(void)
 }
 
 /* USER CODE BEGIN 4 */
+// Re-run the generated I2C1 initialization, after bus recovery (i2c_recover.c) has reset the peripheral
+void i2c1_reinit(void)
+{
+  MX_I2C1_Init();
+}
+
+// I2C2 - second bus, PB10 (SCL) / PB11 (SDA), same configuration as I2C1.  It is not configured
+// in the .ioc file, so the pin, clock and interrupt set up HAL_I2C_MspInit() does for I2C1 is done here.
+void i2c2_init(void)
+{
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
+
+  __HAL_RCC_GPIOB_CLK_ENABLE();
+  GPIO_InitStruct.Pin = GPIO_PIN_10|GPIO_PIN_11;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_OD;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+  __HAL_RCC_I2C2_CLK_ENABLE();
+
+  hi2c2.Instance = I2C2;
+  hi2c2.Init.ClockSpeed = 100000;
+  hi2c2.Init.DutyCycle = I2C_DUTYCYCLE_2;
+  hi2c2.Init.OwnAddress1 = 0;
+  hi2c2.Init.AddressingMode = I2C_ADDRESSINGMODE_7BIT;
+  hi2c2.Init.DualAddressMode = I2C_DUALADDRESS_DISABLE;
+  hi2c2.Init.OwnAddress2 = 0;
+  hi2c2.Init.GeneralCallMode = I2C_GENERALCALL_DISABLE;
+  hi2c2.Init.NoStretchMode = I2C_NOSTRETCH_DISABLE;
+  if (HAL_I2C_Init(&hi2c2) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  /* I2C2 interrupt Init - transactions are interrupt driven, see i2c_async.c */
+  HAL_NVIC_SetPriority(I2C2_EV_IRQn, IRQ_PRIORITY_DEFAULT, 0);
+  HAL_NVIC_EnableIRQ(I2C2_EV_IRQn);
+  HAL_NVIC_SetPriority(I2C2_ER_IRQn, IRQ_PRIORITY_DEFAULT, 0);
+  HAL_NVIC_EnableIRQ(I2C2_ER_IRQn);
+}
 
 /* USER CODE END 4 */
 
@@ -393,6 +423,15 @@ void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
     HAL_IncTick();
   }
   /* USER CODE BEGIN Callback 1 */
+  if (htim->Instance == TIM1) {
+    event_tick();
+  }
+  else if (htim->Instance == TIM2) {
+    timestamp_overflow();
+  }
+  else if (htim->Instance == TIM3) {
+    sampler_tick();
+  }
 
   /* USER CODE END Callback 1 */
 }
@@ -0,0 +1,95 @@
+// File: ring_buffer.c
+//
+// Single producer / single consumer byte ring buffer.
+// Indexes are free running 16-bit counters; (head - tail) is always the number of bytes held,
+// and the buffer size (power of 2) masks an index into the storage array.
+
+#include <stdint.h> // uint8_t
+#include "ring_buffer.h"
+
+void ring_init(RING_BUFFER * r, uint8_t * buf, uint16_t size)
+{
+	r->buf = buf;
+	r->size = size;
+	r->head = 0;
+	r->tail = 0;
+	r->high_water = 0;
+}
+
+// Number of bytes waiting to be read
+uint16_t ring_count(const RING_BUFFER * r)
+{
+	return (uint16_t)(r->head - r->tail);
+}
+
+// Number of bytes that may be written before the buffer is full
+uint16_t ring_space(const RING_BUFFER * r)
+{
+	return r->size - ring_count(r);
+}
+
+// Producer: add a byte to the buffer
+// Return 1 if the byte was added, 0 if the buffer is full
+int ring_put(RING_BUFFER * r, uint8_t c)
+{
+	uint16_t head = r->head;
+	uint16_t count = (uint16_t)(head - r->tail);
+	if(count >= r->size) return 0; // full
+
+	r->buf[head & (r->size - 1)] = c;
+	RING_BARRIER(); // data must land before the consumer can see the new head
+	r->head = head + 1;
+
+	if(++count > r->high_water) r->high_water = count;
+	return 1;
+}
+
+// Consumer: remove a byte from the buffer
+// Return the byte (0-255), or -1 if the buffer is empty
+int ring_get(RING_BUFFER * r)
+{
+	uint16_t tail = r->tail;
+	if(tail == r->head) return -1; // empty
+
+	uint8_t c = r->buf[tail & (r->size - 1)];
+	RING_BARRIER(); // read the data before releasing the slot to the producer
+	r->tail = tail + 1;
+	return c;
+}
+
+// Producer: add as many bytes as will fit, returning the number written
+uint16_t ring_write(RING_BUFFER * r, const uint8_t * data, uint16_t count)
+{
+	uint16_t head = r->head;
+	uint16_t space = r->size - (uint16_t)(head - r->tail);
+	if(count > space) count = space;
+
+	for(uint16_t i=0;i<count;i++)
+		r->buf[(head + i) & (r->size - 1)] = data[i];
+	RING_BARRIER();
+	r->head = head + count;
+
+	uint16_t held = (uint16_t)(r->head - r->tail);
+	if(held > r->high_water) r->high_water = held;
+	return count;
+}
+
+// Consumer: return the number of bytes readable as one contiguous block, starting at *pdata.
+// This is less than ring_count() when the data wraps the end of the storage array.
+uint16_t ring_linear(const RING_BUFFER * r, uint8_t ** pdata)
+{
+	uint16_t tail = r->tail;
+	uint16_t count = (uint16_t)(r->head - tail);
+	uint16_t offset = tail & (r->size - 1);
+	uint16_t to_end = r->size - offset;
+
+	*pdata = &r->buf[offset];
+	return count < to_end? count : to_end;
+}
+
+// Consumer: release count bytes previously obtained with ring_linear()
+void ring_advance(RING_BUFFER * r, uint16_t count)
+{
+	RING_BARRIER();
+	r->tail += count;
+}
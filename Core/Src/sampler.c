@@ -0,0 +1,296 @@
+// File: sampler.c
+//
+// Background sampling: TIM3 paces a short list of I2C1 register reads, and the completed reads are
+// time stamped into a RAM ring buffer for the command line to drain at its leisure.
+//
+// Each tick (TIM3 update interrupt) submits every read in the list to the I2C1 transaction queue
+// (i2c_bus_submit()), so the reads of one tick go out back to back without any help from the main
+// loop.  Each read's completion callback (I2C interrupt context) appends a SAMPLE to the ring.  The
+// tick handler is the only place a read is submitted and the completion callbacks are the only
+// producer for the ring, both at the same interrupt priority, so the ring stays single producer /
+// single consumer.
+//
+// Timing is reported two ways:
+//   jitter - TIM3 counts from the update event, so its count when the tick handler runs is the
+//            interrupt latency.  The spread between the smallest and largest latency is the jitter.
+//   missed - a tick that finds the previous tick's reads still queued or on the bus skips its reads,
+//            rather than let the queue grow without bound.  The sample rate is too high for the
+//            bus speed, or something else is holding the bus.
+//
+// TIM3 counts at 1MHz with a 16-bit reload, so periods longer than SAMPLER_PERIOD_MAX_US are split
+// into several timer periods, counted down in the tick handler.
+//
+// Polled I2C1 operations (the register level fast path, probes) hold the bus while they run.  A tick
+// arriving meanwhile has its reads deferred, not failed - they start when the bus is released.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "main.h"   // HAL functions and defines
+#include "command_line.h"
+#include "sampler.h"
+#include "i2c_async.h"
+#include "cl_i2c.h"
+#include "cl_ds3231.h"
+#include "ring_buffer.h"
+#include "timestamp.h"
+
+// HAL_I2C_MODULE_ENABLED will be defined when an I2C interface is enabled within the ioc file
+#ifdef HAL_I2C_MODULE_ENABLED
+
+/* To implement the expected functionality, the following lines would be added to
+   command_line.c, in the cmd_table[]:
+
+	{"sample",    "sample <start Hz|stop|drain|add addr reg count|clear|reset>", 1, cl_sample},
+
+*/
+
+typedef struct {
+	I2C_XFER xfer;
+	uint16_t address;
+	uint8_t reg;
+	uint8_t count;
+	uint8_t data[SAMPLER_DATA_MAX];
+} SAMPLER_READ;
+
+TIM_HandleTypeDef htim3; // not in the .ioc file, see sampler_start()
+SAMPLER_STATS sampler_stats;
+
+static SAMPLER_READ sampler_reads[SAMPLER_READS_MAX] = { // default: DS3231 time and temperature
+		{.address = I2C_ADDRESS_DS3231, .reg = 0x00, .count = 3},
+		{.address = I2C_ADDRESS_DS3231, .reg = 0x11, .count = 2},
+};
+static uint8_t sampler_read_count = 2;
+
+static uint8_t sampler_buffer[SAMPLER_RING_SIZE] __attribute__((aligned(4))); // read in place as SAMPLEs
+static RING_BUFFER sampler_ring;
+
+static volatile uint8_t sampler_running;
+static uint32_t sampler_rate;          // Hz
+static uint16_t sampler_divider;       // timer periods per tick
+static uint16_t sampler_countdown;
+static uint16_t sampler_tick_count;    // tick number, stamped on each sample
+static uint32_t sampler_tick_us;       // timestamp_us() of the current tick
+static volatile uint8_t sampler_pending; // reads of the current tick not yet complete
+
+// I2C completion callback, interrupt context - add the read to the ring buffer
+static void sampler_complete(I2C_XFER * x)
+{
+	SAMPLER_READ * r = x->context;
+	SAMPLE s;
+	s.timestamp = sampler_tick_us;
+	s.tick = sampler_tick_count;
+	s.index = (uint8_t)(r - sampler_reads);
+	s.status = x->status;
+	s.count = r->count;
+	for(int i=0;i<SAMPLER_DATA_MAX;i++)
+		s.data[i] = i < r->count? r->data[i] : 0;
+
+	sampler_stats.samples++;
+	if(x->status != I2C_XFER_DONE)
+		sampler_stats.errors++;
+	// Whole samples only - SAMPLE size divides the ring size, so a sample never wraps the end
+	if(ring_space(&sampler_ring) >= sizeof(SAMPLE))
+		ring_write(&sampler_ring, (const uint8_t *)&s, sizeof(SAMPLE));
+	else
+		sampler_stats.overruns++;
+
+	if(sampler_pending && --sampler_pending == 0) {
+		uint32_t busy = timestamp_us() - sampler_tick_us;
+		if(busy > sampler_stats.busy_max) sampler_stats.busy_max = busy;
+	}
+}
+
+// Called from HAL_TIM_PeriodElapsedCallback(), TIM3 update interrupt context
+void sampler_tick(void)
+{
+	uint16_t latency = (uint16_t)TIM3->CNT; // us since the update event
+	if(!sampler_running || --sampler_countdown) return;
+	sampler_countdown = sampler_divider;
+
+	sampler_stats.ticks++;
+	if(latency < sampler_stats.latency_min) sampler_stats.latency_min = latency;
+	if(latency > sampler_stats.latency_max) sampler_stats.latency_max = latency;
+	if(sampler_pending) {
+		sampler_stats.missed++; // previous tick still on the bus
+		return;
+	}
+
+	sampler_tick_us = timestamp_us() - latency;
+	sampler_tick_count++;
+	sampler_pending = sampler_read_count;
+	for(int i=0;i<sampler_read_count;i++) {
+		SAMPLER_READ * r = &sampler_reads[i];
+		i2c_xfer_init(&r->xfer, r->address, &r->reg, 1, r->data, r->count);
+		r->xfer.callback = sampler_complete;
+		r->xfer.context = r;
+		if(i2c_bus_submit(&i2c_bus1, &r->xfer)) {
+			r->xfer.status = I2C_XFER_ERROR; // refused, callback will not run
+			sampler_complete(&r->xfer);
+		}
+	}
+}
+
+static void sampler_reset(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	sampler_stats = (SAMPLER_STATS){.latency_min = 0xFFFF};
+	sampler_ring.high_water = 0;
+	__set_PRIMASK(primask);
+}
+
+// First use: ring buffer and statistics
+static void sampler_init(void)
+{
+	if(sampler_ring.buf) return;
+	ring_init(&sampler_ring, sampler_buffer, sizeof(sampler_buffer));
+	sampler_reset();
+}
+
+// Start (or restart at a new rate) sampling
+// Return 0 on success, -1 for a rate out of range or a timer that failed to start
+int sampler_start(uint32_t rate_hz)
+{
+	if(!rate_hz || rate_hz > SAMPLER_RATE_MAX || !sampler_read_count) return -1;
+	sampler_stop();
+
+	uint32_t period_us = 1000000 / rate_hz;
+	sampler_divider = (period_us + SAMPLER_PERIOD_MAX_US - 1) / SAMPLER_PERIOD_MAX_US;
+	sampler_countdown = sampler_divider;
+	sampler_rate = rate_hz;
+	sampler_init();
+
+	__HAL_RCC_TIM3_CLK_ENABLE();
+	htim3.Instance = TIM3;
+	htim3.Init.Prescaler = SystemCoreClock / 1000000 - 1; // 1MHz, APB1 timer clock is 72MHz
+	htim3.Init.CounterMode = TIM_COUNTERMODE_UP;
+	htim3.Init.Period = period_us / sampler_divider - 1;
+	htim3.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+	htim3.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+	if(HAL_TIM_Base_Init(&htim3) != HAL_OK) return -1;
+	HAL_NVIC_SetPriority(TIM3_IRQn, IRQ_PRIORITY_DEFAULT, 0);
+	HAL_NVIC_EnableIRQ(TIM3_IRQn);
+
+	sampler_running = 1;
+	if(HAL_TIM_Base_Start_IT(&htim3) != HAL_OK) {
+		sampler_running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+// Stop the timer - reads already on the bus complete into the ring buffer
+void sampler_stop(void)
+{
+	if(!sampler_running) return;
+	sampler_running = 0;
+	HAL_TIM_Base_Stop_IT(&htim3);
+}
+
+// Print and remove every sample in the ring buffer
+static void sampler_drain(void)
+{
+	uint8_t * p;
+	uint16_t drained = 0;
+	while(ring_linear(&sampler_ring, &p) >= sizeof(SAMPLE)) {
+		const SAMPLE * s = (const SAMPLE *)p;
+		const SAMPLER_READ * r = &sampler_reads[s->index];
+		printf("%5u %10lu 0x%02X:%02X ",s->tick,s->timestamp,r->address,r->reg);
+		if(s->status == I2C_XFER_DONE) {
+			for(int i=0;i<s->count;i++)
+				printf(" %02X",s->data[i]);
+			printf("\n");
+		}
+		else
+			printf(" error %d\n",s->status);
+		ring_advance(&sampler_ring, sizeof(SAMPLE));
+		drained++;
+	}
+	printf("%u samples\n",drained);
+}
+
+static void sampler_display(void)
+{
+	printf("Sampling %s",sampler_running? "at ":"stopped");
+	if(sampler_running) printf("%luHz",sampler_rate);
+	printf(", I2C1 reads:");
+	for(int i=0;i<sampler_read_count;i++)
+		printf(" 0x%02X:%02X/%u",sampler_reads[i].address,sampler_reads[i].reg,sampler_reads[i].count);
+	printf("\n");
+	printf("Ticks: %lu, missed deadlines: %lu\n",sampler_stats.ticks,sampler_stats.missed);
+	if(sampler_stats.ticks)
+		printf("Tick latency: %u-%uus, jitter %uus\n",sampler_stats.latency_min,sampler_stats.latency_max,
+				sampler_stats.latency_max - sampler_stats.latency_min);
+	printf("Samples: %lu, errors: %lu, overruns: %lu, longest tick %luus\n",sampler_stats.samples,
+			sampler_stats.errors,sampler_stats.overruns,sampler_stats.busy_max);
+	printf("Buffered: %u of %u, high water %u\n",ring_count(&sampler_ring) / sizeof(SAMPLE),
+			SAMPLER_RING_SIZE / sizeof(SAMPLE),sampler_ring.high_water / sizeof(SAMPLE));
+}
+
+// Background register sampling
+// Expect: "sample"                        status, statistics
+//         "sample start <Hz>"             start (or change rate), default 10Hz
+//         "sample stop"
+//         "sample drain"                  print and remove buffered samples
+//         "sample add <addr> <reg> <count>" add a register read to the list (stopped only)
+//         "sample clear"                  empty the read list (stopped only)
+//         "sample reset"                  clear statistics
+int cl_sample(void)
+{
+	sampler_init();
+	if(argc < 2) {
+		sampler_display();
+		return 0;
+	}
+	switch(argv[1][0]) {
+	case 's':
+		if(argv[1][2] == 'o') {
+			sampler_stop();
+			sampler_display();
+			return 0;
+		}
+		uint32_t rate = argc > 2? strtoul(argv[2],NULL,0) : 10;
+		if(sampler_start(rate)) {
+			printf("Expect 1 to %uHz, and at least one register read\n",SAMPLER_RATE_MAX);
+			return -1;
+		}
+		printf("Sampling at %luHz, TIM3 period %luus x %u\n",rate,htim3.Init.Period + 1,sampler_divider);
+		return 0;
+	case 'd':
+		sampler_drain();
+		return 0;
+	case 'r':
+		sampler_reset();
+		printf("Statistics reset\n");
+		return 0;
+	case 'a':
+	case 'c':
+		if(sampler_running || sampler_pending) {
+			printf("Stop sampling first\n");
+			return -1;
+		}
+		// Buffered samples refer to the read list by index
+		ring_advance(&sampler_ring, ring_count(&sampler_ring));
+		if(argv[1][0] == 'c') {
+			sampler_read_count = 0;
+			return 0;
+		}
+		if(argc < 5) break;
+		uint16_t address = strtol(argv[2],NULL,0);
+		uint16_t reg = strtol(argv[3],NULL,0);
+		uint16_t count = strtol(argv[4],NULL,0);
+		int rc = cl_i2c_validate_address(address);
+		if(rc) return rc;
+		if(reg > 0xFF || !count || count > SAMPLER_DATA_MAX || sampler_read_count >= SAMPLER_READS_MAX) {
+			printf("Expect register 0x00 to 0xFF, 1 to %u bytes, up to %u reads\n",SAMPLER_DATA_MAX,SAMPLER_READS_MAX);
+			return -1;
+		}
+		sampler_reads[sampler_read_count++] = (SAMPLER_READ){.address = address, .reg = (uint8_t)reg, .count = (uint8_t)count};
+		sampler_display();
+		return 0;
+	}
+	printf("Expect: sample <start Hz|stop|drain|add addr reg count|clear|reset>\n");
+	return -1;
+}
+
+#endif // HAL_I2C_MODULE_ENABLED
@@ -0,0 +1,229 @@
+// File: serial.c
+//
+// DMA driven USART2 console input and output.
+//
+// Output:
+// _write() (newlib's back end for printf(), puts(), putchar()) copies its whole payload into a
+// ring buffer and, if the transmitter is idle, starts one DMA transfer covering everything that is
+// buffered.  While that transfer is in flight, following payloads are formatted and appended behind
+// it.  When the transfer completes, HAL_UART_TxCpltCallback() releases the sent bytes and starts the
+// next transfer with whatever accumulated in the meantime.  The ring therefore acts as a double
+// buffer: one region owned by DMA, the remainder owned by the producer.
+//
+// A transfer only covers the contiguous part of the ring; data wrapping the end of the buffer is
+// sent by the following transfer.
+//
+// Interrupt handlers print as well, so the ring has more than one producer: each piece of a payload
+// is appended with interrupts masked (SERIAL_TX_LOCK_BYTES at a time, to bound the interrupt latency).
+// Output from an interrupt handler can therefore land between the pieces of a thread's payload, but
+// never corrupts the ring.
+//
+// If the buffer fills, the caller waits for DMA to make room (nothing is lost).
+// From an interrupt handler, or with interrupts disabled, waiting would dead-lock, so the data
+// is dropped and counted instead.
+//
+// Input:
+// DMA1 channel 6 receives continuously into a small circular buffer.  The half transfer, transfer
+// complete, and USART IDLE line interrupts all report the DMA write position through
+// HAL_UARTEx_RxEventCallback(), which copies the new bytes into a single producer / single consumer
+// ring buffer.  __io_getchar() reads that ring without blocking, returning EOF when it is empty.
+// The IDLE interrupt delivers the tail end of a burst as soon as the line goes quiet, so nothing
+// waits for the DMA buffer to fill.  Bytes arriving while the ring is full are counted as overruns.
+// Ctrl-C is recognized as it arrives, so a running command can be cancelled while the characters
+// typed ahead of it wait in the ring.
+
+#include <stdio.h>
+#include "main.h"   // HAL functions and defines
+#include "serial.h"
+#include "command_line.h"
+#include "events.h"
+#include "timestamp.h"
+
+/* To implement the expected functionality, the following lines would be added to
+   command_line.c, in the cmd_table[]:
+
+    {"uart",      "uart statistics <reset>",                      1, cl_serial_stats},
+
+*/
+
+static uint8_t serial_tx_buffer[SERIAL_TX_BUFFER_SIZE];
+static uint8_t serial_rx_buffer[SERIAL_RX_BUFFER_SIZE];
+static uint8_t serial_rx_dma_buffer[SERIAL_RX_DMA_SIZE]; // written by DMA, circular
+RING_BUFFER serial_tx_ring;
+RING_BUFFER serial_rx_ring;
+SERIAL_STATS serial_stats;
+static volatile uint16_t serial_tx_in_flight; // bytes owned by the active DMA transfer, 0 if idle
+static uint16_t serial_rx_dma_pos; // next byte in serial_rx_dma_buffer[] to copy into serial_rx_ring
+volatile uint32_t serial_rx_timestamp; // timestamp_us() of the most recent receive event
+
+// Start (or restart) circular DMA reception with IDLE line detection
+static void serial_rx_start(void)
+{
+	serial_rx_dma_pos = 0;
+	if(HAL_OK == HAL_UARTEx_ReceiveToIdle_DMA(&huart2, serial_rx_dma_buffer, sizeof(serial_rx_dma_buffer)))
+		serial_stats.rx_starts++;
+}
+
+// Called from MX_USART2_UART_Init(), after HAL_UART_Init() - before anything is printed
+void serial_init(void)
+{
+	ring_init(&serial_tx_ring, serial_tx_buffer, sizeof(serial_tx_buffer));
+	ring_init(&serial_rx_ring, serial_rx_buffer, sizeof(serial_rx_buffer));
+	serial_tx_in_flight = 0;
+	serial_rx_start();
+}
+
+// Return true (non-zero) if the caller is unable to wait for the USART2 DMA transfer to complete
+static int serial_cannot_wait(void)
+{
+	return __get_IPSR() || __get_PRIMASK();
+}
+
+// If the transmitter is idle and data is waiting, start a DMA transfer
+// Must not be interrupted by the DMA / USART2 completion path - see serial_write()
+static void serial_tx_start(void)
+{
+	if(serial_tx_in_flight) return; // completion callback will start the next transfer
+	uint8_t * pdata;
+	uint16_t count = ring_linear(&serial_tx_ring, &pdata);
+	if(!count) return;
+	if(HAL_OK == HAL_UART_Transmit_DMA(&huart2, pdata, count)) {
+		serial_tx_in_flight = count;
+		serial_stats.tx_transfers++;
+	}
+}
+
+// Queue count bytes for transmission, returning the number queued
+static int serial_write(const uint8_t * data, int count)
+{
+	int queued = 0;
+	while(queued < count) {
+		uint16_t chunk = count - queued > SERIAL_TX_LOCK_BYTES? SERIAL_TX_LOCK_BYTES : (uint16_t)(count - queued);
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq(); // an interrupt handler's printf() may be the other producer
+		uint16_t written = ring_write(&serial_tx_ring, data + queued, chunk);
+		serial_tx_start();
+		__set_PRIMASK(primask);
+		queued += written;
+		if(written < chunk) {
+			// Buffer full
+			serial_stats.tx_overflow++;
+			if(serial_cannot_wait()) {
+				serial_stats.tx_dropped += count - queued;
+				break;
+			}
+			while(!ring_space(&serial_tx_ring)) ; // DMA completion will make room
+		}
+	}
+	return queued;
+}
+
+// Over-ride the weak _write() in syscalls.c, sending each payload as a block vs one character at a time
+int _write(int file, char *ptr, int len)
+{
+	(void)file;
+	serial_write((const uint8_t *)ptr, len);
+	return len;
+}
+
+// Define serial output function using UART2
+int __io_putchar(int ch)
+{
+	uint8_t c = (uint8_t)ch;
+	serial_write(&c, 1);
+	return ch;
+}
+
+// Read a character from the receive buffer without waiting
+// Return the character, or EOF (-1) if nothing has been received
+int __io_getchar(void)
+{
+	return ring_get(&serial_rx_ring); // -1 == EOF
+}
+
+// HAL callback, USART2 / DMA interrupt context - receive DMA has written up to dma_pos
+// Called at half transfer, transfer complete, and IDLE line.  Copy new bytes to the receive ring.
+void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t dma_pos)
+{
+	if(huart->Instance != USART2 || dma_pos > SERIAL_RX_DMA_SIZE) return;
+	uint32_t events = EVENT_UART_RX;
+	while(serial_rx_dma_pos != dma_pos) {
+		uint8_t c = serial_rx_dma_buffer[serial_rx_dma_pos];
+		if(c == SERIAL_CTRL_C)
+			events |= EVENT_BREAK;
+		if(!ring_put(&serial_rx_ring, c))
+			serial_stats.rx_overrun++; // consumer too slow, byte lost
+		if(++serial_rx_dma_pos >= SERIAL_RX_DMA_SIZE) {
+			serial_rx_dma_pos = 0;
+			if(dma_pos == SERIAL_RX_DMA_SIZE) break; // transfer complete, DMA wrapped to the start
+		}
+	}
+	serial_rx_timestamp = timestamp_us();
+	event_post(events); // wake the main loop
+}
+
+// HAL callback, USART2 interrupt context - previous DMA transfer has completed
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+	if(huart->Instance != USART2) return;
+	ring_advance(&serial_tx_ring, serial_tx_in_flight);
+	serial_tx_in_flight = 0;
+	serial_tx_start(); // send anything queued while the previous transfer was in flight
+}
+
+// HAL callback, USART2 interrupt context
+// With DMA active, HAL treats every error as blocking and stops the transfer(s) involved.
+// Discard an interrupted transmit and move on; restart reception, keeping what was already received.
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+	if(huart->Instance != USART2) return;
+	if(huart->ErrorCode & HAL_UART_ERROR_ORE)
+		serial_stats.rx_hw_overrun++;
+	if(huart->ErrorCode & (HAL_UART_ERROR_PE | HAL_UART_ERROR_NE | HAL_UART_ERROR_FE))
+		serial_stats.rx_errors++;
+	if(serial_tx_in_flight && huart->gState == HAL_UART_STATE_READY) {
+		serial_stats.tx_dropped += serial_tx_in_flight;
+		HAL_UART_TxCpltCallback(huart);
+	}
+	if(huart->RxState == HAL_UART_STATE_READY) {
+		// The stopped channel's NDTR still shows how far DMA wrote - copy those bytes before the
+		// restart begins again at the start of the buffer
+		uint16_t dma_pos = SERIAL_RX_DMA_SIZE - (uint16_t)__HAL_DMA_GET_COUNTER(huart->hdmarx);
+		if(dma_pos != serial_rx_dma_pos)
+			HAL_UARTEx_RxEventCallback(huart, dma_pos);
+		serial_rx_start();
+	}
+}
+
+// Wait for all buffered output to leave the USART (for example, before a processor reset)
+void serial_flush(void)
+{
+	if(serial_cannot_wait()) return;
+	while(ring_count(&serial_tx_ring) || serial_tx_in_flight) ;
+	while(!(huart2.Instance->SR & USART_SR_TC)) ; // last character has left the shift register
+}
+
+// Display (and optionally reset) serial statistics
+// Expect: "uart" or "uart reset"
+int cl_serial_stats(void)
+{
+	printf("TX buffer: %u bytes, high water %u\n",SERIAL_TX_BUFFER_SIZE,serial_tx_ring.high_water);
+	printf("TX DMA transfers: %lu\n",serial_stats.tx_transfers);
+	printf("TX overflow: %lu, dropped: %lu\n",serial_stats.tx_overflow,serial_stats.tx_dropped);
+	printf("RX buffer: %u bytes, high water %u\n",SERIAL_RX_BUFFER_SIZE,serial_rx_ring.high_water);
+	printf("RX overrun: %lu (buffer full), %lu (USART)\n",serial_stats.rx_overrun,serial_stats.rx_hw_overrun);
+	printf("RX errors: %lu, DMA starts: %lu\n",serial_stats.rx_errors,serial_stats.rx_starts);
+	if(argc > 1 && argv[1][0] == 'r') {
+		serial_stats.tx_transfers = 0;
+		serial_stats.tx_overflow = 0;
+		serial_stats.tx_dropped = 0;
+		serial_stats.rx_overrun = 0;
+		serial_stats.rx_hw_overrun = 0;
+		serial_stats.rx_errors = 0;
+		serial_stats.rx_starts = 0;
+		serial_tx_ring.high_water = 0;
+		serial_rx_ring.high_water = 0;
+		printf("Statistics reset\n");
+	}
+	return 0;
+}
@@ -0,0 +1,144 @@
+// File: task.c
+//
+// Cooperative task scheduler - see task.h
+//
+// task_run() is called from the main loop when EVENT_TASK or EVENT_TIMER is posted.  It runs each
+// active task once, then arranges its next call:
+//  - some task yielded, or is waiting on a condition: post EVENT_TASK, run again right away
+//  - all tasks are in TASK_DELAY() or TASK_WAIT_EVENT(): start the event timer for the earliest
+//    wake up (if any), letting the main loop sleep (WFI) in the meantime
+//
+// A foreground task is started by a command.  The command line holds its prompt, and leaves typed
+// characters in the receive buffer, until the task is done.  Ctrl-C cancels it.
+// Background tasks run until done, and don't affect the command line.
+
+#include <stdio.h>
+#include "main.h"   // HAL functions and defines
+#include "task.h"
+#include "events.h"
+#include "command_line.h"
+
+/* To implement the expected functionality, the following lines would be added to
+   command_line.c, in the cmd_table[]:
+
+    {"tasks",     "list active tasks",                            1, cl_tasks},
+
+*/
+
+static TASK * task_list[TASK_MAX];
+static TASK * task_foreground;
+
+// Add a task to the list, return 0 for success, -1 if no room (or already running)
+static int task_add(TASK * t, TASK_FUNCTION function, const char * name, uint8_t foreground)
+{
+	int slot = -1;
+	for(int i=0;i<TASK_MAX;i++) {
+		if(task_list[i] == t) return -1; // already running
+		if(!task_list[i] && slot < 0) slot = i;
+	}
+	if(slot < 0) return -1;
+
+	t->function = function;
+	t->name = name;
+	t->line = 0;
+	t->delaying = 0;
+	t->waiting = 0;
+	t->foreground = foreground;
+	t->cancel = 0;
+	task_list[slot] = t;
+	if(foreground) task_foreground = t;
+	event_post(EVENT_TASK); // first call
+	return 0;
+}
+
+// Start a foreground task (from a command)
+// Return 0 for success, non-zero if it could not be started
+int task_start(TASK * t, TASK_FUNCTION function, const char * name)
+{
+	if(task_foreground || task_add(t, function, name, 1)) {
+		printf("%s: unable to start task\n",name);
+		return 1;
+	}
+	return 0;
+}
+
+// Start a background task
+// Return 0 for success, non-zero if it could not be started
+int task_start_background(TASK * t, TASK_FUNCTION function, const char * name)
+{
+	return task_add(t, function, name, 0);
+}
+
+// Request a task stop.  Its TASK_ON_CANCEL() section runs on its next turn.
+void task_cancel(TASK * t)
+{
+	t->cancel = 1;
+	event_post(EVENT_TASK);
+}
+
+// Ctrl-C - cancel the task started by the most recent command
+void task_cancel_foreground(void)
+{
+	if(task_foreground) {
+		printf("^C\n");
+		task_cancel(task_foreground);
+	}
+}
+
+// Return non-zero while a foreground task is active (command prompt is held)
+int task_foreground_busy(void)
+{
+	return task_foreground != NULL;
+}
+
+// Run each active task once
+void task_run(void)
+{
+	int run_again = 0;
+	uint32_t sleep_ms = UINT32_MAX;
+
+	for(int i=0;i<TASK_MAX;i++) {
+		TASK * t = task_list[i];
+		if(!t) continue;
+
+		if(t->cancel) t->line = TASK_CANCEL_LINE; // jump to clean-up code
+		if(t->function(t) == TASK_DONE || t->cancel) {
+			// Finished - remove from the list
+			task_list[i] = NULL;
+			if(t == task_foreground) {
+				task_foreground = NULL;
+				cl_prompt(); // command complete, release the command line
+			}
+			continue;
+		}
+
+		if(t->delaying) {
+			int32_t remaining = (int32_t)(t->wake_tick - HAL_GetTick());
+			if(remaining < 1)
+				run_again = 1;
+			else if((uint32_t)remaining < sleep_ms)
+				sleep_ms = remaining;
+		}
+		else if(!t->waiting) run_again = 1; // else, EVENT_TASK will wake it
+	} // for-loop
+
+	if(run_again)
+		event_post(EVENT_TASK);
+	else if(sleep_ms != UINT32_MAX)
+		event_timer_start(sleep_ms);
+}
+
+// List active tasks
+int cl_tasks(void)
+{
+	int count = 0;
+	for(int i=0;i<TASK_MAX;i++) {
+		TASK * t = task_list[i];
+		if(!t) continue;
+		printf("%-12s%s%s%s\n",t->name,t->foreground? "foreground":"background",t->delaying? ", delaying":"",
+				t->waiting? ", waiting":"");
+		count++;
+	}
+	if(!count) printf("No tasks\n");
+	return 0;
+}
@@ -0,0 +1,49 @@
+// File: timestamp.c
+//
+// TIM2 is configured to increment each micro-second, rolling over every 65.536ms.
+// Counting the roll-overs (update interrupt) extends the counter to 32 bits, which wraps after
+// about 71 minutes.  Differences between two time stamps remain correct across that wrap as long
+// as they are computed with unsigned 32-bit subtraction.
+//
+// The DWT cycle counter is also enabled here, for timestamp_cycles().
+
+#include "main.h"   // HAL functions and defines
+#include "timestamp.h"
+
+static volatile uint16_t timestamp_high; // count of TIM2 roll-overs
+
+// Called from MX_TIM2_Init(), replaces HAL_TIM_Base_Start()
+void timestamp_init(void)
+{
+	timestamp_high = 0;
+	HAL_TIM_Base_Start_IT(&htim2); // update interrupt on each roll-over
+
+	// Enable the DWT cycle counter
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+}
+
+// Called from HAL_TIM_PeriodElapsedCallback() for TIM2
+void timestamp_overflow(void)
+{
+	timestamp_high++;
+}
+
+// Return the current time in micro-seconds
+// Safe to call from any context, including interrupt handlers with priority above TIM2, where the
+// roll-over may be pending but not yet counted.
+uint32_t timestamp_us(void)
+{
+	uint16_t high, low;
+	do {
+		high = timestamp_high;
+		low = (uint16_t)TIM2->CNT;
+	} while(high != timestamp_high); // roll-over counted while reading - try again
+
+	// Roll-over occurred but its interrupt hasn't run yet (we're in an equal or higher priority handler)
+	if((TIM2->SR & TIM_SR_UIF) && low < 0x8000)
+		high++;
+
+	return ((uint32_t)high << 16) | low;
+}